@@ -0,0 +1,139 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#include <gip/ChunkCache.h>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+
+namespace gip {
+
+    ChunkCache& ChunkCache::Instance() {
+        static ChunkCache cache;
+        return cache;
+    }
+
+    ChunkCache::Scope::Scope(float size) : _Size(size) {
+        ChunkCache& cache(Instance());
+        std::lock_guard<std::mutex> lock(cache._Lock);
+        cache._Scopes.insert(_Size);
+    }
+
+    ChunkCache::Scope::~Scope() {
+        ChunkCache& cache(Instance());
+        std::lock_guard<std::mutex> lock(cache._Lock);
+        cache._Scopes.erase(cache._Scopes.find(_Size));
+        // back within the budget of whatever is left, releasing everything if the cache is now off
+        size_t budget(Options::CacheSize() * 1024 * 1024);
+        if (!cache._Scopes.empty())
+            budget = std::max(budget, (size_t)(*cache._Scopes.rbegin() * 1024 * 1024));
+        cache.Trim(budget);
+    }
+
+    size_t ChunkCache::Budget() const {
+        float size(Options::CacheSize());
+        std::lock_guard<std::mutex> lock(_Lock);
+        if (!_Scopes.empty()) size = std::max(size, *_Scopes.rbegin());
+        return size * 1024 * 1024;
+    }
+
+    unsigned long ChunkCache::Epoch(unsigned long ds) {
+        std::lock_guard<std::mutex> lock(_Lock);
+        return _Epochs[ds];
+    }
+
+    bool ChunkCache::Get(unsigned long ds, int band, const Rect<int>& rect, GDALDataType type, void* data, size_t bytes) {
+        boost::shared_ptr< std::vector<unsigned char> > cached;
+        {
+            std::lock_guard<std::mutex> lock(_Lock);
+            std::map<key, entry>::iterator e(_Entries.find(Key(ds, band, rect, type)));
+            if (e == _Entries.end() || e->second.data->size() != bytes) {
+                _Misses++;
+                return false;
+            }
+            _Hits++;
+            _Ages.splice(_Ages.begin(), _Ages, e->second.age);
+            cached = e->second.data;
+        }
+        // copy outside the lock, the entry is kept alive by the shared pointer
+        std::memcpy(data, &(*cached)[0], bytes);
+        return true;
+    }
+
+    void ChunkCache::Put(unsigned long ds, int band, const Rect<int>& rect, GDALDataType type, const void* data, size_t bytes, unsigned long epoch) {
+        size_t budget(Budget());
+        if (bytes == 0 || bytes > budget) return;
+        boost::shared_ptr< std::vector<unsigned char> > copy(new std::vector<unsigned char>(bytes));
+        std::memcpy(&(*copy)[0], data, bytes);
+
+        std::lock_guard<std::mutex> lock(_Lock);
+        // written since the data was read
+        if (_Epochs[ds] != epoch) return;
+        key k(Key(ds, band, rect, type));
+        std::map<key, entry>::iterator e(_Entries.find(k));
+        if (e != _Entries.end()) Erase(e);
+        _Ages.push_front(k);
+        entry& added(_Entries[k]);
+        added.data = copy;
+        added.age = _Ages.begin();
+        _Bytes += bytes;
+        Trim(budget);
+    }
+
+    void ChunkCache::Invalidate(unsigned long ds, int band, const Rect<int>& rect) {
+        std::lock_guard<std::mutex> lock(_Lock);
+        _Epochs[ds]++;
+        std::map<key, entry>::iterator e(_Entries.lower_bound(key(ds, band, INT_MIN, INT_MIN, 0, 0, 0)));
+        while (e != _Entries.end() && std::get<0>(e->first) == ds && std::get<1>(e->first) == band) {
+            const key& k(e->first);
+            bool overlaps = std::get<2>(k) < rect.x1() && rect.x0() < std::get<2>(k) + std::get<4>(k)
+                         && std::get<3>(k) < rect.y1() && rect.y0() < std::get<3>(k) + std::get<5>(k);
+            if (overlaps)
+                Erase(e++);
+            else ++e;
+        }
+    }
+
+    void ChunkCache::Purge(unsigned long ds) {
+        std::lock_guard<std::mutex> lock(_Lock);
+        _Epochs.erase(ds);
+        std::map<key, entry>::iterator e(_Entries.lower_bound(key(ds, INT_MIN, INT_MIN, INT_MIN, 0, 0, 0)));
+        while (e != _Entries.end() && std::get<0>(e->first) == ds) Erase(e++);
+    }
+
+    void ChunkCache::Clear() {
+        std::lock_guard<std::mutex> lock(_Lock);
+        _Entries.clear();
+        _Ages.clear();
+        _Bytes = 0;
+    }
+
+    void ChunkCache::Erase(std::map<key, entry>::iterator e) {
+        _Bytes -= e->second.data->size();
+        _Ages.erase(e->second.age);
+        _Entries.erase(e);
+    }
+
+    void ChunkCache::Trim(size_t budget) {
+        while (_Bytes > budget && !_Ages.empty()) Erase(_Entries.find(_Ages.back()));
+    }
+
+} // namespace gip
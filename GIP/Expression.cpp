@@ -0,0 +1,217 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#include <gip/Expression.h>
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+namespace gip {
+    using std::string;
+
+    //! Number of values evaluated at a time
+    static const size_t ExpressionBlockSize = 1024;
+
+    Expression::Expression(string expr)
+        : _String(expr), _Depth(0), _Size(0) {
+        size_t pos(0);
+        ParseSum(pos);
+        if (Peek(pos) != 0) Error("unexpected character", pos);
+        if (_Program.empty()) Error("empty expression", pos);
+    }
+
+    void Expression::Evaluate(const float* const* vars, size_t n, float* out) const {
+        std::vector<float> stack(_Depth * ExpressionBlockSize);
+        for (size_t start=0; start<n; start+=ExpressionBlockSize) {
+            size_t len(std::min(ExpressionBlockSize, n-start));
+            // number of blocks on the stack, the top one is being worked on
+            size_t depth(0);
+            for (std::vector<Instruction>::const_iterator ins=_Program.begin(); ins!=_Program.end(); ins++) {
+                float* a;
+                switch (ins->code) {
+                    case Constant:
+                        a = &stack[depth++ * ExpressionBlockSize];
+                        std::fill(a, a+len, ins->value);
+                        break;
+                    case Variable:
+                        a = &stack[depth++ * ExpressionBlockSize];
+                        std::copy(vars[ins->index] + start, vars[ins->index] + start + len, a);
+                        break;
+                    case Negate:
+                    case Sqrt:
+                    case Abs:
+                    case Exp:
+                    case Log: {
+                        a = &stack[(depth-1) * ExpressionBlockSize];
+                        switch (ins->code) {
+                            case Negate: for (size_t i=0; i<len; i++) a[i] = -a[i]; break;
+                            case Sqrt: for (size_t i=0; i<len; i++) a[i] = std::sqrt(a[i]); break;
+                            case Abs: for (size_t i=0; i<len; i++) a[i] = std::fabs(a[i]); break;
+                            case Exp: for (size_t i=0; i<len; i++) a[i] = std::exp(a[i]); break;
+                            case Log: for (size_t i=0; i<len; i++) a[i] = std::log(a[i]); break;
+                            default: break;
+                        }
+                        break;
+                    }
+                    default: {
+                        // binary operators, result replaces the first operand
+                        const float* b(&stack[(depth-1) * ExpressionBlockSize]);
+                        a = &stack[(depth-2) * ExpressionBlockSize];
+                        depth--;
+                        switch (ins->code) {
+                            case Add: for (size_t i=0; i<len; i++) a[i] += b[i]; break;
+                            case Subtract: for (size_t i=0; i<len; i++) a[i] -= b[i]; break;
+                            case Multiply: for (size_t i=0; i<len; i++) a[i] *= b[i]; break;
+                            case Divide: for (size_t i=0; i<len; i++) a[i] /= b[i]; break;
+                            case Power: for (size_t i=0; i<len; i++) a[i] = std::pow(a[i], b[i]); break;
+                            case Min: for (size_t i=0; i<len; i++) a[i] = std::min(a[i], b[i]); break;
+                            case Max: for (size_t i=0; i<len; i++) a[i] = std::max(a[i], b[i]); break;
+                            default: break;
+                        }
+                    }
+                }
+            }
+            // a complete program leaves its result as the only block
+            const float* result(&stack[0]);
+            std::copy(result, result+len, out+start);
+        }
+    }
+
+    void Expression::ParseSum(size_t& pos) {
+        ParseProduct(pos);
+        for (char c=Peek(pos); c == '+' || c == '-'; c=Peek(pos)) {
+            pos++;
+            ParseProduct(pos);
+            Emit(c == '+' ? Add : Subtract);
+        }
+    }
+
+    void Expression::ParseProduct(size_t& pos) {
+        ParseUnary(pos);
+        for (char c=Peek(pos); c == '*' || c == '/'; c=Peek(pos)) {
+            pos++;
+            ParseUnary(pos);
+            Emit(c == '*' ? Multiply : Divide);
+        }
+    }
+
+    void Expression::ParseUnary(size_t& pos) {
+        char c(Peek(pos));
+        if (c == '-' || c == '+') {
+            pos++;
+            ParseUnary(pos);
+            if (c == '-') Emit(Negate);
+        } else ParsePower(pos);
+    }
+
+    void Expression::ParsePower(size_t& pos) {
+        ParseAtom(pos);
+        if (Peek(pos) == '^') {
+            pos++;
+            // right associative, and allows a signed exponent
+            ParseUnary(pos);
+            Emit(Power);
+        }
+    }
+
+    void Expression::ParseAtom(size_t& pos) {
+        char c(Peek(pos));
+        if (c == '(') {
+            pos++;
+            ParseSum(pos);
+            if (Peek(pos) != ')') Error("expected )", pos);
+            pos++;
+        } else if (std::isdigit((unsigned char)c) || c == '.') {
+            const char* begin(_String.c_str() + pos);
+            char* end;
+            float value(std::strtod(begin, &end));
+            if (end == begin) Error("invalid number", pos);
+            pos += end - begin;
+            Emit(Constant, value);
+        } else if (std::isalpha((unsigned char)c) || c == '_') {
+            size_t begin(pos);
+            while (pos < _String.size() && (std::isalnum((unsigned char)_String[pos]) || _String[pos] == '_')) pos++;
+            string name(_String.substr(begin, pos-begin));
+            if (Peek(pos) == '(') {
+                Code code(Sqrt);
+                unsigned int nargs(1);
+                if (name == "sqrt") code = Sqrt;
+                else if (name == "abs") code = Abs;
+                else if (name == "exp") code = Exp;
+                else if (name == "log") code = Log;
+                else if (name == "min") { code = Min; nargs = 2; }
+                else if (name == "max") { code = Max; nargs = 2; }
+                else Error("unknown function " + name, begin);
+                pos++;
+                for (unsigned int i=0; i<nargs; i++) {
+                    if (i > 0) {
+                        if (Peek(pos) != ',') Error("expected ,", pos);
+                        pos++;
+                    }
+                    ParseSum(pos);
+                }
+                if (Peek(pos) != ')') Error("expected )", pos);
+                pos++;
+                Emit(code);
+            } else {
+                std::vector<string>::const_iterator v(std::find(_Variables.begin(), _Variables.end(), name));
+                if (v == _Variables.end()) {
+                    _Variables.push_back(name);
+                    v = _Variables.end() - 1;
+                }
+                Emit(Variable, 0, v - _Variables.begin());
+            }
+        } else if (c == 0) {
+            Error("unexpected end", pos);
+        } else Error("unexpected character", pos);
+    }
+
+    char Expression::Peek(size_t& pos) const {
+        while (pos < _String.size() && std::isspace((unsigned char)_String[pos])) pos++;
+        return pos < _String.size() ? _String[pos] : 0;
+    }
+
+    void Expression::Error(string msg, size_t pos) const {
+        std::stringstream err;
+        err << "Expression \"" << _String << "\": " << msg << " at position " << pos;
+        throw std::runtime_error(err.str());
+    }
+
+    void Expression::Emit(Code code, float value, unsigned int index) {
+        Instruction ins = {code, value, index};
+        _Program.push_back(ins);
+        switch (code) {
+            case Constant:
+            case Variable:
+                _Size++;
+                _Depth = std::max(_Depth, _Size);
+                break;
+            case Add: case Subtract: case Multiply: case Divide: case Power: case Min: case Max:
+                _Size--;
+                break;
+            default: break;
+        }
+    }
+
+} // namespace gip
@@ -26,6 +26,9 @@
 
 #include <gip/GeoAlgorithms.h>
 #include <gip/gip_gdal.h>
+#include <gip/Expression.h>
+#include <gip/Morphology.h>
+#include <gip/LinearAlgebra.h>
 
 //#include <gdal/ogrsf_frmts.h>
 //#include <gdal/gdalwarper.h>
@@ -47,6 +50,8 @@ namespace gip {
                   float sa_degrees, int erode, int dilate, int cloudheight, dictionary metadata ) {
         const std::string ACCA_VERSION("0.4.0");
         if (Options::Verbose() > 1) cout << "GIPPY: ACCA - " << image.Basename() << endl;
+        // the passes below read the same chunks of the bands again
+        ChunkCache::Scope cache;
 
         float th_red(0.08);
         float th_ndsi(0.7);
@@ -75,23 +80,35 @@ namespace gip {
         metadata["ACCA_cloudheight"] = to_string(cloudheight);
         imgout.SetMeta(metadata);
 
+        // pass1 and ambclouds are read back from scratch rather than from the output file
+        GeoImage scratch(GeoImage::Scratch(image, GDT_Byte, 2));
+        scratch.SetNoData(0);
+        int s_pass1(0);
+        int s_ambclouds(1);
+
         vector<string> bands_used({"RED","GREEN","NIR","SWIR1","LWIR"});
 
-        CImg<float> red, green, nir, swir1, temp, ndsi, b56comp;
-        CImg<unsigned char> nonclouds, ambclouds, clouds, mask, temp2;
         float cloudsum(0), scenesize(0);
 
-        ChunkSet chunks(image.XSize(),image.YSize());
-        Rect<int> chunk;
+        ChunkSet chunks(image.BlockChunks());
+
+        //! Pass 1 results for one chunk
+        struct pass1 {
+            CImg<unsigned char> clouds, ambclouds;
+            float cloudsum, scenesize;
+        };
 
         //if (Options::Verbose()) cout << image.Basename() << " - ACCA (dev-version)" << endl;
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            chunk = chunks[iChunk];
-            red = image["RED"].Read<float>(chunk);
-            green = image["GREEN"].Read<float>(chunk);
-            nir = image["NIR"].Read<float>(chunk);
-            swir1 = image["SWIR1"].Read<float>(chunk);
-            temp = image["LWIR"].Read<float>(chunk);
+        ForEachChunk<pass1>(chunks, [&](unsigned int, const Rect<int>& chunk) {
+            PooledBuffer<float> pred, pgreen, pnir, pswir1, ptemp;
+            CImg<float> ndsi, b56comp;
+            CImg<unsigned char> nonclouds, mask;
+            pass1 result;
+            CImg<float>& red(image["RED"].ReadInto(*pred, chunk));
+            CImg<float>& green(image["GREEN"].ReadInto(*pgreen, chunk));
+            CImg<float>& nir(image["NIR"].ReadInto(*pnir, chunk));
+            CImg<float>& swir1(image["SWIR1"].ReadInto(*pswir1, chunk));
+            CImg<float>& temp(image["LWIR"].ReadInto(*ptemp, chunk));
 
             mask = image.NoDataMask(bands_used, chunk)^=1;
 
@@ -107,7 +124,7 @@ namespace gip {
                 // Filter3
                 temp.get_threshold(th_temp);
 
-            ambclouds =
+            result.ambclouds =
                 (nonclouds^1).mul(
                 // Filter4
                 b56comp.get_threshold(th_comp) |=
@@ -118,27 +135,33 @@ namespace gip {
                 // Filter7
                 (nir.get_div(swir1).threshold(th_nirswir1)^=1) );
 
-            clouds =
-                (nonclouds + ambclouds)^=1;
+            result.clouds =
+                (nonclouds + result.ambclouds)^=1;
 
                 // Filter8 - warm/cold
                 //b56comp.threshold(th_warm) + 1);
 
             //nonclouds.mul(mask);
-            clouds.mul(mask);
-            ambclouds.mul(mask);
-
-            cloudsum += clouds.sum();
-            scenesize += mask.sum();
-
-            imgout[b_pass1].Write<unsigned char>(clouds,chunk);
-            imgout[b_ambclouds].Write<unsigned char>(ambclouds,chunk);
+            result.clouds.mul(mask);
+            result.ambclouds.mul(mask);
+
+            result.cloudsum = result.clouds.sum();
+            result.scenesize = mask.sum();
+            return result;
+        }, [&](unsigned int, const Rect<int>& chunk, pass1& result) {
+            cloudsum += result.cloudsum;
+            scenesize += result.scenesize;
+
+            scratch[s_pass1].Write<unsigned char>(result.clouds,chunk);
+            scratch[s_ambclouds].Write<unsigned char>(result.ambclouds,chunk);
+            imgout[b_pass1].Write<unsigned char>(result.clouds,chunk);
+            imgout[b_ambclouds].Write<unsigned char>(result.ambclouds,chunk);
             //imgout[0].Write(nonclouds,iChunk);
             if (Options::Verbose() > 3) cout << "Processed chunk " << chunk << " of " << chunks.Size() << endl;
-        }
+        });
         // Cloud statistics
         float cloudcover = cloudsum / scenesize;
-        CImg<float> tstats = image["LWIR"].AddMask(imgout[b_pass1]).Stats();
+        CImg<float> tstats = image["LWIR"].AddMask(scratch[s_pass1]).Stats();
         if (Options::Verbose() > 1) {
             cout.precision(4);
             cout << "   Cloud Cover = " << cloudcover*100 << "%" << endl;
@@ -148,10 +171,13 @@ namespace gip {
         // Pass 2 (thermal processing)
         bool addclouds(false);
         if ((cloudcover > 0.004) && (tstats(2) < 22.0)) {
-            float th0 = image["LWIR"].Percentile(83.5);
-            float th1 = image["LWIR"].Percentile(97.5);
+            // all thresholds from one pass
+            float pcts[] = {83.5, 97.5, 98.75};
+            CImg<float> thresholds = image["LWIR"].Percentiles(std::vector<float>(pcts, pcts+3));
+            float th0 = thresholds[0];
+            float th1 = thresholds[1];
             if (tstats[4] > 0) {
-                float th2 = image["LWIR"].Percentile(98.75);
+                float th2 = thresholds[2];
                 float shift(0);
                 shift = tstats[3] * ((tstats[4] > 1.0) ? 1.0 : tstats[4]);
                 //cout << "Percentiles = " << th0 << ", " << th1 << ", " << th2 << ", " << shift << endl;
@@ -160,23 +186,23 @@ namespace gip {
                 th1 += shift;
             }
             image["LWIR"].ClearMasks();
-            CImg<float> warm_stats = image["LWIR"].AddMask(imgout[b_ambclouds]).AddMask(image["LWIR"] < th1).AddMask(image["LWIR"] > th0).Stats();
+            CImg<float> warm_stats = image["LWIR"].AddMask(scratch[s_ambclouds]).AddMask(image["LWIR"] < th1).AddMask(image["LWIR"] > th0).Stats();
             if (Options::Verbose() > 1)
                 warm_stats.print("Warm Cloud stats(min,max,mean,sd,skew,count)");
             image["LWIR"].ClearMasks();
             if (((warm_stats(5)/scenesize) < 0.4) && (warm_stats(2) < 22)) {
                 if (Options::Verbose() > 2) cout << "Accepting warm clouds" << endl;
-                imgout[b_ambclouds].AddMask(image["LWIR"] < th1).AddMask(image["LWIR"] > th0);
+                scratch[s_ambclouds].AddMask(image["LWIR"] < th1).AddMask(image["LWIR"] > th0);
                 addclouds = true;
             } else {
                 // Cold clouds
-                CImg<float> cold_stats = image["LWIR"].AddMask(imgout[b_ambclouds]).AddMask(image["LWIR"] < th0).Stats();
+                CImg<float> cold_stats = image["LWIR"].AddMask(scratch[s_ambclouds]).AddMask(image["LWIR"] < th0).Stats();
                 if (Options::Verbose() > 1)
                     cold_stats.print("Cold Cloud stats(min,max,mean,sd,skew,count)");
                 image["LWIR"].ClearMasks();
                 if (((cold_stats(5)/scenesize) < 0.4) && (cold_stats(2) < 22)) {
                     if (Options::Verbose() > 2) cout << "Accepting cold clouds" << endl;
-                    imgout[b_ambclouds].AddMask(image["LWIR"] < th0);
+                    scratch[s_ambclouds].AddMask(image["LWIR"] < th0);
                     addclouds = true;
                 } else
                     if (Options::Verbose() > 2) cout << "Rejecting all ambiguous clouds" << endl;
@@ -198,47 +224,39 @@ namespace gip {
                  << "dy       = " << dy << endl
                  << "snmearlen = " << smearlen << endl ;
 
-        // shift-style smear
-        int steps(std::max(std::abs(dx), std::abs(dy)));
-        int stepsize(1);
-        if (dilate > 0)
-            stepsize = std::max(dilate / 4, 1);
         if (Options::Verbose() > 2)
-            cerr << "dilate = " << dilate << endl
-                 << "steps  = " << steps << endl
-                 << "stepsize  = " << stepsize << endl ;
+            cerr << "dilate = " << dilate << endl;
 
-        int padding(std::ceil(double(dilate)/2));
+        // halo for erosion and dilation, plus the smear
+        int padding(MorphologyPadding(erode, dilate));
         if (cloudheight > 0)
-            padding += std::max(abs(dx),abs(dy));
+            padding += std::ceil(std::max(std::fabs(dx), std::fabs(dy)));
         chunks.Padding(padding);
 
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            chunk = chunks[iChunk];
-            if (Options::Verbose() > 3)
-                cout << "Chunk " << chunk << " of " << chunks.Size() << endl;
-            clouds = imgout[b_pass1].Read<unsigned char>(chunk).mul(image.NoDataMask(bands_used, chunk)^=1);
+        ForEachChunk< CImg<unsigned char> >(chunks, [&](unsigned int, const Rect<int>& chunk) {
+            CImg<unsigned char> clouds;
+            clouds = scratch[s_pass1].Read<unsigned char>(chunk).mul(image.NoDataMask(bands_used, chunk)^=1);
             // should this be a |= ?
-            if (addclouds) clouds += imgout[b_ambclouds].Read<unsigned char>(chunk);
+            if (addclouds) clouds += scratch[s_ambclouds].Read<unsigned char>(chunk);
             clouds|=(image.SaturationMask(bands_used, 255, chunk));
             // Majority filter
             //clouds|=clouds.get_convolve(filter).threshold(majority));
             if (erode > 0)
-                clouds.erode(erode, erode);
+                Erode(clouds, erode, erode);
             if (dilate > 0)
-                clouds.dilate(dilate,dilate);
-            if (smearlen > 0) {
-                temp2 = clouds;
-                for ( float step(1); step <= steps; step += 1)
-                    clouds |= temp2.get_shift(
-                        -int(std::round(dx*step/steps)),
-                        -int(std::round(dy*step/steps)));
-            }
+                Dilate(clouds, dilate, dilate);
+            // smear clouds along the solar azimuth
+            if (smearlen > 0)
+                ProjectMask(clouds, dx, dy);
+            return clouds;
+        }, [&](unsigned int, const Rect<int>& chunk, CImg<unsigned char>& clouds) {
+            if (Options::Verbose() > 3)
+                cout << "Chunk " << chunk << " of " << chunks.Size() << endl;
             imgout[b_cloudmask].Write<unsigned char>(clouds,chunk);
             // Inverse and multiply by nodata mask to get good data mask
             imgout[b_finalmask].Write<unsigned char>((clouds^=1).mul(image.NoDataMask(bands_used, chunk)^=1), chunk);
             // TODO - add in snow mask
-        }
+        });
         return imgout;
     }
 
@@ -262,10 +280,7 @@ namespace gip {
             metadata["CLOUD_cloudheight"] = to_string(cloudheight);
         imgout.SetMeta(metadata);
 
-        CImg<int16_t> clouds, temp2;
-
-        ChunkSet chunks(image.XSize(),image.YSize());
-        Rect<int> chunk;
+        ChunkSet chunks(image.BlockChunks());
 
         //! Coarse shadow covering smear of image
         float xres(image.Resolution().x());
@@ -282,39 +297,30 @@ namespace gip {
                  << "dy       = " << dy << endl
                  << "snmearlen = " << smearlen << endl ;
 
-        int steps(std::max(std::abs(dx), std::abs(dy)));
-        int stepsize(1);
-        if (dilate > 0)
-            stepsize = std::max(dilate / 4, 1);
-
         if (Options::Verbose() > 2)
-            cerr << "dilate = " << dilate << endl
-                 << "steps  = " << steps << endl
-                 << "stepsize  = " << stepsize << endl ;
+            cerr << "dilate = " << dilate << endl;
 
-        int padding(std::ceil(double(dilate)/2));
+        // halo for erosion and dilation, plus the smear
+        int padding(MorphologyPadding(erode, dilate));
         if (cloudheight > 0)
-            padding += std::max(abs(dx),abs(dy));
+            padding += std::ceil(std::max(std::fabs(dx), std::fabs(dy)));
         chunks.Padding(padding);
 
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            chunk = chunks[iChunk];
-            if (Options::Verbose() > 3)
-                cout << "Chunk " << chunk << " of " << chunks.Size() << endl;
+        ForEachChunk< CImg<int16_t> >(chunks, [&](unsigned int, const Rect<int>& chunk) {
+            CImg<int16_t> clouds;
             clouds = image[b_mask].Read<int16_t>(chunk).mul(image[b_mask].NoDataMask(chunk)^=1);
             if (erode > 0)
-                clouds.erode(erode, erode);
+                Erode(clouds, erode, erode);
             if (dilate > 0)
-                clouds.dilate(dilate,dilate);
-            if (cloudheight > 0) {
-                temp2 = clouds;
-                for ( float step(1); step <= steps; step += 1)
-                    clouds |= temp2.get_shift(
-                        -int(std::round(dx*step/steps)),
-                        -int(std::round(dy*step/steps)));
-            }
-            imgout[b_mask].Write<int16_t>((clouds^=1).mul(image[b_mask].NoDataMask(chunk)^=1),chunk);
-        }
+                Dilate(clouds, dilate, dilate);
+            if (cloudheight > 0)
+                ProjectMask(clouds, dx, dy);
+            return (clouds^=1).mul(image[b_mask].NoDataMask(chunk)^=1);
+        }, [&](unsigned int, const Rect<int>& chunk, CImg<int16_t>& clouds) {
+            if (Options::Verbose() > 3)
+                cout << "Chunk " << chunk << " of " << chunks.Size() << endl;
+            imgout[b_mask].Write<int16_t>(clouds,chunk);
+        });
         return imgout;
     }
 
@@ -339,7 +345,8 @@ namespace gip {
         CImg<double> stats;
         float lo, hi;
         for (unsigned int b=0; b<img.NumBands(); b++) {
-            stats = img[b].Stats();
+            // approximate statistics are enough to scale for display
+            stats = img[b].ApproxStats();
             lo = std::max(stats(2) - 3*stats(3), stats(0));
             hi = std::min(stats(2) + 3*stats(3), stats(1));
             if ((lo == hi) && (lo == 1)) lo = 0;
@@ -455,6 +462,8 @@ namespace gip {
     GeoImage Fmask(const GeoImage& image, string filename, int tolerance, int dilate, dictionary metadata) {
         if (Options::Verbose() > 1)
             cout << "GIPPY: Fmask (tol=" << tolerance << ", d=" << dilate << ") - " << filename << endl;
+        // the passes below read the same chunks of the bands again
+        ChunkCache::Scope cache;
 
         GeoImage imgout(filename, image, GDT_Byte, 5);
         int b_final(0); imgout[b_final].SetDescription("finalmask");
@@ -465,35 +474,44 @@ namespace gip {
         imgout.SetNoData(0);
         imgout.SetMeta(metadata);
         float nodataval(-32768);
-        // Output probabilties (for debugging/analysis)
-        GeoImage probout(filename + "-prob", image, GDT_Float32, 2);
+        // Cloud probabilities, kept in scratch between passes
+        GeoImage probout(GeoImage::Scratch(image, GDT_Float32, 2));
         probout[0].SetDescription("wcloud");
         probout[1].SetDescription("lcloud");
         probout.SetNoData(nodataval);
 
-        CImg<unsigned char> clouds, pcp, wmask, lmask, mask, redsatmask, greensatmask;
-        CImg<float> red, nir, green, blue, swir1, swir2, BT, ndvi, ndsi, white, vprob;
-        float _ndvi, _ndsi;
         long datapixels(0);
         long cloudpixels(0);
         long landpixels(0);
         //CImg<double> wstats(image.Size()), lstats(image.Size());
         //int wloc(0), lloc(0);
 
-        ChunkSet chunks(image.XSize(),image.YSize());
-
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            blue = image["BLUE"].Read<double>(chunks[iChunk]);
-            red = image["RED"].Read<double>(chunks[iChunk]);
-            green = image["GREEN"].Read<double>(chunks[iChunk]);
-            nir = image["NIR"].Read<double>(chunks[iChunk]);
-            swir1 = image["SWIR1"].Read<double>(chunks[iChunk]);
-            swir2 = image["SWIR2"].Read<double>(chunks[iChunk]);
-            BT = image["LWIR"].Read<double>(chunks[iChunk]);
-            mask = image.NoDataMask(chunks[iChunk])^=1;
+        ChunkSet chunks(image.BlockChunks());
+
+        //! First pass results for one chunk
+        struct pass1 {
+            CImg<float> vprob;
+            CImg<unsigned char> pcp, water, land;
+            long datapixels, cloudpixels;
+        };
+
+        ForEachChunk<pass1>(chunks, [&](unsigned int, const Rect<int>& chunk) {
+            PooledBuffer<float> pblue, pred, pgreen, pnir, pswir1, pswir2, pBT;
+            CImg<unsigned char> pcp, wmask, mask, redsatmask, greensatmask;
+            CImg<float> ndvi, ndsi, white, vprob;
+            float _ndvi, _ndsi;
+            pass1 result;
+            CImg<float>& blue(image["BLUE"].ReadInto(*pblue, chunk));
+            CImg<float>& red(image["RED"].ReadInto(*pred, chunk));
+            CImg<float>& green(image["GREEN"].ReadInto(*pgreen, chunk));
+            CImg<float>& nir(image["NIR"].ReadInto(*pnir, chunk));
+            CImg<float>& swir1(image["SWIR1"].ReadInto(*pswir1, chunk));
+            CImg<float>& swir2(image["SWIR2"].ReadInto(*pswir2, chunk));
+            CImg<float>& BT(image["LWIR"].ReadInto(*pBT, chunk));
+            mask = image.NoDataMask(chunk)^=1;
             ndvi = (nir-red).div(nir+red);
             ndsi = (green-swir1).div(green+swir1);
-            white = image.Whiteness(chunks[iChunk]);
+            white = image.Whiteness(chunk);
 
             // Potential cloud pixels
             pcp =
@@ -508,8 +526,8 @@ namespace gip {
                 & white.get_threshold(0.7,false,true)^=1
                 & nir.get_div(swir1).threshold(0.75);
 
-            redsatmask = image["RED"].SaturationMask(255, chunks[iChunk]);
-            greensatmask = image["GREEN"].SaturationMask(255, chunks[iChunk]);
+            redsatmask = image["RED"].SaturationMask(255, chunk);
+            greensatmask = image["GREEN"].SaturationMask(255, chunk);
             vprob = red;
             // Calculate "variability probability"
             cimg_forXY(vprob,x,y) {
@@ -517,19 +535,26 @@ namespace gip {
                 _ndsi = (greensatmask(x,y) && swir1(x,y) > green(x,y)) ? 0 : abs(ndsi(x,y));
                 vprob(x,y) = 1 - std::max(white(x,y), std::max(_ndsi, _ndvi));
             }
-            probout[1].Write(vprob, chunks[iChunk]);
+            result.vprob = vprob;
 
-            datapixels += mask.sum();
-            cloudpixels += pcp.sum();
+            result.datapixels = mask.sum();
+            result.cloudpixels = pcp.sum();
             wmask = ((ndvi.get_threshold(0.01,false,true)^=1) &= (nir.get_threshold(0.01,false,true)^=1))|=
                     ((ndvi.get_threshold(0.1,false,true)^=1) &= (nir.get_threshold(0.05,false,true)^=1));
 
-            imgout[b_pcp].Write(pcp.mul(mask), chunks[iChunk]);        // Potential cloud pixels
-            imgout[b_water].Write(wmask.get_mul(mask), chunks[iChunk]);   // Clear-sky water
-            CImg<unsigned char> landimg((wmask^1).mul(pcp^1).mul(mask));
-            landpixels += landimg.sum();
-            imgout[b_land].Write(landimg, chunks[iChunk]);    // Clear-sky land
-        }
+            result.pcp = pcp.get_mul(mask);
+            result.water = wmask.get_mul(mask);
+            result.land = (wmask^1).mul(pcp^1).mul(mask);
+            return result;
+        }, [&](unsigned int, const Rect<int>& chunk, pass1& result) {
+            datapixels += result.datapixels;
+            cloudpixels += result.cloudpixels;
+            landpixels += result.land.sum();
+            probout[1].Write(result.vprob, chunk);
+            imgout[b_pcp].Write(result.pcp, chunk);        // Potential cloud pixels
+            imgout[b_water].Write(result.water, chunk);   // Clear-sky water
+            imgout[b_land].Write(result.land, chunk);    // Clear-sky land
+        });
         // floodfill....seems bad way
         //shadowmask = nir.draw_fill(nir.width()/2,nir.height()/2,)
 
@@ -544,8 +569,10 @@ namespace gip {
         image["LWIR"].ClearMasks();
         GeoRaster landBT(image["LWIR"].AddMask(imgout[b_land]));
         image["LWIR"].ClearMasks();
-        double Tlo(landBT.Percentile(17.5));
-        double Thi(landBT.Percentile(82.5));
+        float pcts[] = {17.5, 82.5};
+        CImg<float> landpcts(landBT.Percentiles(std::vector<float>(pcts, pcts+2)));
+        double Tlo(landpcts[0]);
+        double Thi(landpcts[1]);
 
         if (Options::Verbose() > 2) {
             cout << "PCP = " << 100*cloudpixels/(double)datapixels << "%" << endl;
@@ -554,22 +581,24 @@ namespace gip {
         }
 
         // Calculate cloud probabilities for over water and land
-        CImg<float> wprob, lprob;
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            mask = image.NoDataMask(chunks[iChunk])^=1;
-            BT = image["LWIR"].Read<double>(chunks[iChunk]);
-            swir1 = image["SWIR1"].Read<double>(chunks[iChunk]);
+        ForEachChunk< CImgList<float> >(chunks, [&](unsigned int, const Rect<int>& chunk) {
+            PooledBuffer<float> pBT, pswir1, pvprob;
+            CImg<unsigned char> mask = image.NoDataMask(chunk)^=1;
+            CImg<float>& BT(image["LWIR"].ReadInto(*pBT, chunk));
+            CImg<float>& swir1(image["SWIR1"].ReadInto(*pswir1, chunk));
 
             // Water Clouds = temp probability x brightness probability
-            wprob = ((Twater - BT)/=4.0).mul( swir1.min(0.11)/=0.11 ).mul(mask);
-            probout[0].Write(wprob, chunks[iChunk]);
+            CImg<float> wprob = ((Twater - BT)/=4.0).mul( swir1.min(0.11)/=0.11 ).mul(mask);
 
             // Land Clouds = temp probability x variability probability
-            vprob = probout[0].Read<double>(chunks[iChunk]);
-            lprob = ((Thi + 4-BT)/=(Thi+4-(Tlo-4))).mul( vprob ).mul(mask);
+            CImg<float>& vprob(probout[1].ReadInto(*pvprob, chunk));
+            CImg<float> lprob = ((Thi + 4-BT)/=(Thi+4-(Tlo-4))).mul( vprob ).mul(mask);
             //1 - image.NDVI(*chunks[iChunk]).abs().max(image.NDSI(*chunks[iChunk]).abs()).max(image.Whiteness(*chunks[iChunk]).abs()) );
-            probout[1].Write( lprob, chunks[iChunk]);
-        }
+            return CImgList<float>(wprob, lprob);
+        }, [&](unsigned int, const Rect<int>& chunk, CImgList<float>& probs) {
+            probout[0].Write(probs[0], chunk);
+            probout[1].Write(probs[1], chunk);
+        });
 
         // Thresholds
         float tol((tolerance-3)*0.1);
@@ -582,17 +611,20 @@ namespace gip {
         // 3x3 filter of 1's for majority filter
         //CImg<int> filter(3,3,1,1, 1);
         int erode = 5;
-        int padding(double(std::max(dilate,erode)+1)/2);
+        int padding(MorphologyPadding(erode, dilate));
         chunks.Padding(padding);
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            mask = image.NoDataMask(chunks[iChunk])^=1;
-            pcp = imgout[b_pcp].Read<double>(chunks[iChunk]);
-            wmask = imgout[b_water].Read<double>(chunks[iChunk]);
-            BT = image["LWIR"].Read<double>(chunks[iChunk]);
-
-            lprob = probout[1].Read<double>(chunks[iChunk]);
-
-            clouds =
+        ForEachChunk< CImgList<unsigned char> >(chunks, [&](unsigned int, const Rect<int>& chunk) {
+            PooledBuffer<unsigned char> ppcp, pwmask;
+            PooledBuffer<float> pBT, pwprob, plprob;
+            CImg<unsigned char> mask = image.NoDataMask(chunk)^=1;
+            CImg<unsigned char>& pcp(imgout[b_pcp].ReadInto(*ppcp, chunk));
+            CImg<unsigned char>& wmask(imgout[b_water].ReadInto(*pwmask, chunk));
+            CImg<float>& BT(image["LWIR"].ReadInto(*pBT, chunk));
+
+            CImg<float>& wprob(probout[0].ReadInto(*pwprob, chunk));
+            CImg<float>& lprob(probout[1].ReadInto(*plprob, chunk));
+
+            CImg<unsigned char> clouds =
                 (pcp & wmask & wprob.threshold(0.5))|=
                 (pcp & (wmask^1) & lprob.threshold(lthresh))|=
                 (lprob.get_threshold(0.99) & (wmask^1))|=
@@ -601,15 +633,17 @@ namespace gip {
             // Majority filter
             //mask.convolve(filter).threshold(5);
             if (erode > 0)
-                clouds.erode(erode, erode);
+                Erode(clouds, erode, erode);
             if (dilate > 0)
-                clouds.dilate(dilate, dilate);
+                Dilate(clouds, dilate, dilate);
 
             //cimg_forXY(nodatamask,x,y) if (!nodatamask(x,y)) mask(x,y) = 0;
             clouds.mul(mask);
-            imgout[b_clouds].Write(clouds, chunks[iChunk]);
-            imgout[b_final].Write((clouds^=1).mul(mask), chunks[iChunk]);
-        }
+            return CImgList<unsigned char>(clouds, (clouds^1).mul(mask));
+        }, [&](unsigned int, const Rect<int>& chunk, CImgList<unsigned char>& masks) {
+            imgout[b_clouds].Write(masks[0], chunk);
+            imgout[b_final].Write(masks[1], chunk);
+        });
 
         return imgout;
     }
@@ -691,122 +725,144 @@ namespace gip {
         return imgout;
     }*/
 
-    //void Indices(const GeoImage& ImageIn, string basename, std::vector<std::string> products) {
-    dictionary Indices(const GeoImage& image, dictionary products, dictionary metadata) {
+    //! Compute spectral indices, one Int16 file (gain 0.0001) per product
+    /*!
+        Built-in and user products are Expressions over band names, compiled once.  All products
+        are computed in a single pass: each needed band is read once per chunk, the nodata mask of
+        every band is computed once, each product is evaluated over the chunk and quantized to
+        Int16 directly, and chunks are written by the worker that computed them so different
+        outputs are written concurrently.
+    */
+    dictionary Indices(const GeoImage& image, dictionary products, dictionary metadata, dictionary expressions) {
         if (Options::Verbose() > 1) std::cout << "GIPPY: Indices" << std::endl;
 
-        float nodataout = -32768;
-
-        std::map< string, GeoImage > imagesout;
-        std::map<string, string>::const_iterator iprod;
-        std::map<string, string> filenames;
-        string prodname;
-        for (iprod=products.begin(); iprod!=products.end(); iprod++) {
-            //imagesout[*iprod] = GeoImageIO<float>(GeoImage(basename + '_' + *iprod, image, GDT_Int16));
-            if (Options::Verbose() > 2) cout << iprod->first << " -> " << iprod->second << endl;
-            prodname = iprod->first;
-            imagesout[prodname] = GeoImage(iprod->second, image, GDT_Int16, 1);
-            imagesout[prodname].SetNoData(nodataout);
-            imagesout[prodname].SetGain(0.0001);
-            imagesout[prodname].SetUnits("other");
-            imagesout[prodname].SetMeta(metadata);
-            imagesout[prodname][0].SetDescription(prodname);
-            filenames[prodname] = imagesout[prodname].Filename();
-        }
-        if (imagesout.size() == 0) throw std::runtime_error("No indices selected for calculation!");
-
-        std::map< string, std::vector<string> > colors;
-        colors["ndvi"] = {"NIR","RED"};
-        colors["evi"] = {"NIR","RED","BLUE"};
-        colors["lswi"] = {"NIR","SWIR1"};
-        colors["ndsi"] = {"SWIR1","GREEN"};
-        colors["ndwi"] = {"GREEN","NIR"};
-        colors["bi"] = {"BLUE","NIR"};
-        colors["satvi"] = {"SWIR1","RED", "SWIR2"};
-        colors["msavi2"] = {"NIR","RED"};
-        colors["vari"] = {"RED","GREEN","BLUE"};
-        colors["brgt"] = {"RED","GREEN","BLUE","NIR"};
-        // Tillage indices
-        colors["ndti"] = {"SWIR2","SWIR1"};
-        colors["crc"] = {"SWIR1","SWIR2","BLUE"};
-        colors["crcm"] = {"SWIR1","SWIR2","GREEN"};
-        colors["isti"] = {"SWIR1","SWIR2"};
-        colors["sti"] = {"SWIR1","SWIR2"};
-
-        // Figure out what colors are needed
-        std::set< string > used_colors;
-        std::set< string >::const_iterator isstr;
-        std::vector< string >::const_iterator ivstr;
-        for (iprod=products.begin(); iprod!=products.end(); iprod++) {
-            for (ivstr=colors[iprod->first].begin();ivstr!=colors[iprod->first].end();ivstr++) {
-                used_colors.insert(*ivstr);
+        const short nodataout = -32768;
+        const double gain = 0.0001;
+
+        static const std::map<string, Expression> builtins = {
+            {"ndvi", Expression("(NIR-RED)/(NIR+RED)")},
+            {"evi", Expression("2.5*(NIR-RED)/(NIR + 6*RED - 7.5*BLUE + 1)")},
+            {"lswi", Expression("(NIR-SWIR1)/(NIR+SWIR1)")},
+            {"ndsi", Expression("(GREEN-SWIR1)/(GREEN+SWIR1)")},
+            {"ndwi", Expression("(GREEN-NIR)/(GREEN+NIR)")},
+            {"bi", Expression("0.5*(BLUE+NIR)")},
+            {"satvi", Expression("1.5*(SWIR1-RED)/(SWIR1+RED+0.5) - 0.5*SWIR2")},
+            {"msavi2", Expression("0.5*(2*NIR+1 - sqrt((2*NIR+1)^2 - 8*(NIR-RED)))")},
+            {"vari", Expression("(GREEN-RED)/(GREEN+RED-BLUE)")},
+            {"brgt", Expression("0.3*BLUE + 0.3*RED + 0.1*NIR + 0.3*GREEN")},
+            // Tillage indices
+            {"ndti", Expression("(SWIR1-SWIR2)/(SWIR1+SWIR2)")},
+            {"crc", Expression("(SWIR1-BLUE)/(SWIR2+BLUE)")},
+            {"crcm", Expression("(SWIR1-GREEN)/(SWIR2+GREEN)")},
+            {"isti", Expression("SWIR2/SWIR1")},
+            {"sti", Expression("SWIR1/SWIR2")}
+        };
+
+        // Compile products and figure out what bands are needed
+        std::vector<Expression> exprs;
+        std::vector<string> bandnames;
+        // for each product, indices into bandnames of its variables
+        std::vector< std::vector<unsigned int> > prodbands;
+        for (dictionary::const_iterator iprod=products.begin(); iprod!=products.end(); iprod++) {
+            dictionary::const_iterator iexpr(expressions.find(iprod->first));
+            if (iexpr != expressions.end()) {
+                exprs.push_back(Expression(iexpr->second));
+            } else {
+                std::map<string, Expression>::const_iterator ibuiltin(builtins.find(iprod->first));
+                if (ibuiltin == builtins.end()) throw std::runtime_error("Unknown index " + iprod->first);
+                exprs.push_back(ibuiltin->second);
+            }
+            const vector<string>& vars(exprs.back().Variables());
+            prodbands.push_back(vector<unsigned int>());
+            for (unsigned int v=0; v<vars.size(); v++) {
+                if (!image.BandExists(vars[v]))
+                    throw std::runtime_error("Index " + iprod->first + " needs missing band " + vars[v]);
+                vector<string>::const_iterator b(std::find(bandnames.begin(), bandnames.end(), vars[v]));
+                if (b == bandnames.end()) {
+                    bandnames.push_back(vars[v]);
+                    b = bandnames.end() - 1;
+                }
+                prodbands.back().push_back(b - bandnames.begin());
             }
         }
+        if (exprs.size() == 0) throw std::runtime_error("No indices selected for calculation!");
+        // the nodata mask keeps one bit per band
+        if (bandnames.size() > 64) throw std::runtime_error("Indices can use at most 64 bands");
         if (Options::Verbose() > 2) {
             cout << "Colors used: ";
-            for (isstr=used_colors.begin();isstr!=used_colors.end();isstr++) cout << " " << *isstr;
+            for (unsigned int b=0; b<bandnames.size(); b++) cout << " " << bandnames[b];
             cout << endl;
         }
 
-        CImg<float> red, green, blue, nir, swir1, swir2, cimgout, cimgmask, tmpimg;
+        std::vector<GeoImage> imagesout;
+        dictionary filenames;
+        for (dictionary::const_iterator iprod=products.begin(); iprod!=products.end(); iprod++) {
+            if (Options::Verbose() > 2) cout << iprod->first << " -> " << iprod->second << endl;
+            imagesout.push_back(GeoImage(iprod->second, image, GDT_Int16, 1));
+            GeoImage& imgout(imagesout.back());
+            imgout.SetNoData(nodataout);
+            imgout.SetGain(gain);
+            imgout.SetUnits("other");
+            imgout.SetMeta(metadata);
+            imgout[0].SetDescription(iprod->first);
+            filenames[iprod->first] = imgout.Filename();
+        }
+        unsigned int numbands(bandnames.size());
+        unsigned int numprods(exprs.size());
 
-        ChunkSet chunks(image.XSize(),image.YSize());
+        ChunkSet chunks(image.BlockChunks());
 
         // need to add overlap
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            if (Options::Verbose() > 3) cout << "Chunk " << chunks[iChunk] << " of " << image[0].Size() << endl;
-            for (isstr=used_colors.begin();isstr!=used_colors.end();isstr++) {
-                if (*isstr == "RED") red = image["RED"].Read<float>(chunks[iChunk]);
-                else if (*isstr == "GREEN") green = image["GREEN"].Read<float>(chunks[iChunk]);
-                else if (*isstr == "BLUE") blue = image["BLUE"].Read<float>(chunks[iChunk]);
-                else if (*isstr == "NIR") nir = image["NIR"].Read<float>(chunks[iChunk]);
-                else if (*isstr == "SWIR1") swir1 = image["SWIR1"].Read<float>(chunks[iChunk]);
-                else if (*isstr == "SWIR2") swir2 = image["SWIR2"].Read<float>(chunks[iChunk]);
+        ForEachChunk(chunks, [&](unsigned int, const Rect<int>& chunk) {
+            std::vector< CImg<float> > bands(numbands);
+            std::vector<const float*> data(numbands);
+            PooledBuffer<uint64_t> pinvalid;
+            PooledBuffer<float> pvalues;
+            PooledBuffer<int16_t> pout;
+            size_t npix((size_t)chunk.width() * chunk.height());
+            uint64_t* invalid(pinvalid->assign(chunk.width(), chunk.height()).fill(0).data());
+
+            // read each band once, marking its nodata pixels with its bit
+            for (unsigned int b=0; b<numbands; b++) {
+                const GeoRaster& band(image[bandnames[b]]);
+                BufferPool<float>::Acquire(bands[b]);
+                band.ReadInto(bands[b], chunk);
+                data[b] = bands[b].data();
+                if (band.NoData()) {
+                    const float nodata(band.NoDataValue());
+                    for (size_t i=0; i<npix; i++) if (data[b][i] == nodata) invalid[i] |= uint64_t(1) << b;
+                }
             }
 
-            for (iprod=products.begin(); iprod!=products.end(); iprod++) {
-                prodname = iprod->first;
-                //string pname = iprod->toupper();
-                if (prodname == "ndvi") {
-                    cimgout = (nir-red).div(nir+red);
-                } else if (prodname == "evi") {
-                    cimgout = 2.5*(nir-red).div(nir + 6*red - 7.5*blue + 1);
-                } else if (prodname == "lswi") {
-                    cimgout = (nir-swir1).div(nir+swir1);
-                } else if (prodname == "ndsi") {
-                    cimgout = (green-swir1).div(green+swir1);
-                } else if (prodname == "ndwi") {
-                    cimgout = (green-nir).div(green+nir);
-                } else if (prodname == "bi") {
-                    cimgout = 0.5*(blue+nir);
-                } else if (prodname == "satvi") {
-                    float L(0.5);
-                    cimgout = (((1.0+L)*(swir1 - red)).div(swir1+red+L)) - (0.5*swir2);
-                } else if (prodname == "msavi2") {
-                    tmpimg = (nir*2)+1;
-                    cimgout = (tmpimg - (tmpimg.pow(2) - ((nir-red)*8).sqrt())) * 0.5;
-                } else if (prodname == "vari") {
-                    cimgout = (green-red).div(green+red-blue);
-                } else if (prodname == "brgt") {
-                    cimgout = (0.3*blue + 0.3*red + 0.1*nir + 0.3*green);
-                // Tillage indices
-                } else if (prodname == "ndti") {
-                    cimgout = (swir1-swir2).div(swir1+swir2);
-                } else if (prodname == "crc") {
-                    cimgout = (swir1-blue).div(swir2+blue);
-                } else if (prodname == "crcm") {
-                    cimgout = (swir1-green).div(swir2+green);
-                } else if (prodname == "isti") {
-                    cimgout = swir2.div(swir1);
-                } else if (prodname == "sti") {
-                    cimgout = swir1.div(swir2);
+            // one plane per product
+            int16_t* out(pout->assign(chunk.width(), chunk.height(), 1, numprods).data());
+            float* values(pvalues->assign(chunk.width(), chunk.height()).data());
+            std::vector<const float*> vars;
+            for (unsigned int p=0; p<numprods; p++) {
+                vars.clear();
+                uint64_t bits(0);
+                for (unsigned int v=0; v<prodbands[p].size(); v++) {
+                    vars.push_back(data[prodbands[p][v]]);
+                    bits |= uint64_t(1) << prodbands[p][v];
+                }
+                exprs[p].Evaluate(vars.empty() ? NULL : &vars[0], npix, values);
+                int16_t* o(out + p*npix);
+                for (size_t i=0; i<npix; i++) {
+                    if ((invalid[i] & bits) || std::isnan(values[i])) {
+                        o[i] = nodataout;
+                    } else {
+                        // rounded to nearest, as GDAL converts floats written to Int16, and kept clear of nodataout
+                        double v(std::round(values[i] / gain));
+                        o[i] = (int16_t)std::max(-32767.0, std::min(32767.0, v));
+                    }
                 }
-                // TODO don't read mask again...create here
-                cimgmask = image.NoDataMask(colors[prodname], chunks[iChunk]);
-                cimg_forXY(cimgout,x,y) if (cimgmask(x,y)) cimgout(x,y) = nodataout;
-                imagesout[prodname].Write(cimgout,chunks[iChunk]);
             }
-        }
+            for (unsigned int b=0; b<numbands; b++) BufferPool<float>::Release(bands[b]);
+
+            if (Options::Verbose() > 3) cout << "Chunk " << chunk << " of " << image[0].Size() << endl;
+            for (unsigned int p=0; p<numprods; p++)
+                imagesout[p][0].WriteRaw(pout->get_shared_channel(p), chunk);
+        });
         return filenames;
     }
 
@@ -821,53 +877,101 @@ namespace gip {
         imgout.SetNoData(nodataout);
         //imgout.SetGain(0.0001);
         imgout.CopyMeta(img);
-        CImg<float> cimg;
-        CImg<unsigned char> mask;
-
-        ChunkSet chunks(img.XSize(),img.YSize());
-
-        for (unsigned int bout=0; bout<numbands; bout++) {
-            //if (Options::Verbose() > 4) cout << "Band " << bout << endl;
-            for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-                cimg = img[0].Read<float>(chunks[iChunk]) * coef(0, bout);;
-                for (unsigned int bin=1; bin<numbands; bin++) {
-                    cimg = cimg + (img[bin].Read<float>(chunks[iChunk]) * coef(bin, bout));
+        ChunkSet chunks(img.BlockChunks());
+
+        // out = in coef', taken over pixel-interleaved blocks of the input cube
+        const size_t blocksize(256);
+        CImg<float> coefT(coef.get_transpose());
+
+        // the cube is read once per chunk and all output bands are computed together
+        ForEachChunk< CImg<float> >(chunks, [&](unsigned int, const Rect<int>& chunk) {
+            PooledBuffer<float> pcube;
+            CImg<float>& cube(img.ReadInto(*pcube, chunk));
+            size_t n((size_t)cube.width() * cube.height());
+            CImg<float> cimgs(cube.width(), cube.height(), 1, numbands);
+            std::vector<float> pixels(blocksize * numbands), product(blocksize * numbands);
+            std::vector<unsigned char> invalid(blocksize);
+            for (size_t start=0; start<n; start+=blocksize) {
+                size_t len(std::min(blocksize, n - start));
+                std::fill(invalid.begin(), invalid.begin() + len, 0);
+                for (unsigned int b=0; b<numbands; b++) {
+                    const float* band(cube.data() + b*n + start);
+                    bool nodata(img[b].NoData());
+                    float nodatavalue(img[b].NoDataValue());
+                    for (size_t p=0; p<len; p++) {
+                        pixels[p*numbands + b] = band[p];
+                        if (nodata && band[p] == nodatavalue) invalid[p] = 1;
+                    }
+                }
+                Gemm(len, numbands, numbands, &pixels[0], numbands, coefT.data(), numbands, &product[0], numbands);
+                for (unsigned int b=0; b<numbands; b++) {
+                    float* band(cimgs.data() + b*n + start);
+                    for (size_t p=0; p<len; p++)
+                        band[p] = invalid[p] ? nodataout : product[p*numbands + b];
                 }
-                mask = img.NoDataMask(chunks[iChunk]);
-                cimg_forXY(cimg,x,y) if (mask(x,y)) cimg(x,y) = nodataout;
-                imgout[bout].Write(cimg, chunks[iChunk]);
             }
-        }
+            return cimgs;
+        }, [&](unsigned int, const Rect<int>& chunk, CImg<float>& cimgs) {
+            for (unsigned int bout=0; bout<numbands; bout++)
+                imgout[bout].Write(cimgs.get_shared_channel(bout), chunk);
+        });
         return imgout;
     }
 
+    //! Mahalanobis distance of every pixel from means, with K the inverse covariance, written to raster
+    /*!
+        Pixels are centered into pixel-interleaved blocks, multiplied by K with one Gemm per block
+        and scored with a dot product of each row of the product with the centered pixel.
+    */
+    template<class T> void MahalanobisScores(const GeoImage& img, GeoRaster& raster, const CImg<double>& K, const CImg<double>& means) {
+        const size_t blocksize(256);
+        unsigned int nb(img.NumBands());
+        std::vector<T> k(K.begin(), K.end()), m(means.begin(), means.end());
+        ForEachChunk< CImg<T> >(img.BlockChunks(), [&](unsigned int, const Rect<int>& chunk) {
+            PooledBuffer<T> pcube;
+            CImg<T>& cube(img.ReadInto(*pcube, chunk));
+            size_t n((size_t)cube.width() * cube.height());
+            CImg<T> scores(cube.width(), cube.height());
+            std::vector<T> centered(blocksize * nb), product(blocksize * nb);
+            for (size_t start=0; start<n; start+=blocksize) {
+                size_t len(std::min(blocksize, n - start));
+                for (unsigned int b=0; b<nb; b++) {
+                    const T* band(cube.data() + b*n + start);
+                    for (size_t p=0; p<len; p++) centered[p*nb + b] = band[p] - m[b];
+                }
+                // K is symmetric, so x' K x is the dot of each row of X K with the row of X
+                Gemm(len, nb, nb, &centered[0], nb, &k[0], nb, &product[0], nb);
+                for (size_t p=0; p<len; p++) {
+                    const T *x(&centered[p*nb]), *y(&product[p*nb]);
+                    T score(0);
+                    for (unsigned int b=0; b<nb; b++) score += x[b] * y[b];
+                    scores[start + p] = score;
+                }
+            }
+            return scores;
+        }, [&](unsigned int, const Rect<int>& chunk, CImg<T>& scores) {
+            raster.Write(scores, chunk);
+        });
+    }
+
     //! Runs the RX Detector (RXD) anamoly detection algorithm
-    GeoImage RXD(const GeoImage& img, string filename) {
-        if (img.NumBands() < 2) throw std::runtime_error("RXD: At least two bands must be supplied");
+    GeoImage RXD(const GeoImage& img, string filename, bool single) {
+        unsigned int nb(img.NumBands());
+        if (nb < 2) throw std::runtime_error("RXD: At least two bands must be supplied");
 
         GeoImage imgout(filename, img, GDT_Byte, 1);
         imgout.SetBandName("RXD", 1);
 
-        CImg<double> covariance = SpectralCovariance(img);
+        // band means and covariance from one pass
+        JointMoments moments(img.JointStats(true));
+        CImg<double> covariance(nb, nb), bandmeans(nb);
+        cimg_forXY(covariance,x,y) covariance(x,y) = moments.Covariance(y, x);
+        cimg_forX(bandmeans,x) bandmeans(x) = moments[x].Mean();
         CImg<double> K = covariance.invert();
-        CImg<double> chip, chipout, pixel;
-
-        // Calculate band means
-        CImg<double> bandmeans(img.NumBands());
-        cimg_forX(bandmeans, x) {
-            bandmeans(x) = img[x].Stats()[2];
-        }
 
-        ChunkSet chunks(img.XSize(),img.YSize());
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            chip = img.Read<double>(chunks[iChunk]);
-            chipout = CImg<double>(chip, "xyzc");
-            cimg_forXY(chip,x,y) {
-                pixel = chip.get_crop(x,y,0,0,x,y,0,chip.spectrum()-1).unroll('x') - bandmeans;
-                chipout(x,y) = (pixel * K.get_transpose() * pixel.get_transpose())[0];
-            }
-            imgout[0].Write(chipout, chunks[iChunk]);
-        }
+        if (single)
+            MahalanobisScores<float>(img, imgout[0], K, bandmeans);
+        else MahalanobisScores<double>(img, imgout[0], K, bandmeans);
         return imgout;
     }
 
@@ -882,15 +986,15 @@ namespace gip {
         imgout.SetBandName("Mean", 1);
         imgout.SetBandName("StdDev", 2);
 
-        CImgList<double> stats;
-        ChunkSet chunks(img.XSize(),img.YSize());
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
+        ChunkSet chunks(img.BlockChunks());
+        ForEachChunk< CImg<double> >(chunks, [&](unsigned int, const Rect<int>& chunk) {
+            return img.SpectralMoments(chunk);
+        }, [&](unsigned int, const Rect<int>& chunk, CImg<double>& stats) {
             if (Options::Verbose() > 2)
-                std::cout << "Processing chunk " << chunks[iChunk] << " of " << img.Size() << std::endl;
-            stats = img.SpectralStatistics(chunks[iChunk]);
-            imgout[0].Write(stats[0], chunks[iChunk]);
-            imgout[1].Write(stats[1], chunks[iChunk]);
-        }
+                std::cout << "Processing chunk " << chunk << " of " << img.Size() << std::endl;
+            imgout[0].Write(stats.get_shared_channel(0), chunk);
+            imgout[1].Write(stats.get_shared_channel(1), chunk);
+        });
         if (Options::Verbose())
             std::cout << "Spectral statistics written to " << imgout.Filename() << std::endl;
         return imgout;
@@ -942,32 +1046,10 @@ namespace gip {
     CImg<double> SpectralCovariance(const GeoImage& img) {
         unsigned int NumBands(img.NumBands());
 
-        CImg<double> covariance(NumBands, NumBands, 1, 1, 0), bandchunk, matrixchunk;
-        CImg<unsigned char> mask;
-        int validsize;
-
-        ChunkSet chunks = img.Chunks();
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            // Bands x NumPixels
-            matrixchunk = CImg<double>(NumBands, chunks[iChunk].area(),1,1,0);
-            mask = img.NoDataMask(chunks[iChunk]);
-            validsize = mask.size() - mask.sum();
-
-            int p(0);
-            for (unsigned int b=0;b<NumBands;b++) {
-                bandchunk = img[b].Read<double>(chunks[iChunk]);
-                p = 0;
-                cimg_forXY(bandchunk,x,y) {
-                    if (mask(x,y)==0) matrixchunk(b,p++) = bandchunk(x,y);
-                }
-            }
-            if (p != (int)img.Size()) matrixchunk.crop(0,0,NumBands-1,p-1);
-            covariance += (matrixchunk.get_transpose() * matrixchunk)/(validsize-1);
-        }
-        // Subtract Mean
-        CImg<double> means(NumBands);
-        for (unsigned int b=0; b<NumBands; b++) means(b) = img[b].Stats()[2]; //cout << "Mean b" << b << " = " << means(b) << endl; }
-        covariance -= (means.get_transpose() * means);
+        // sums and cross products of deviations of every chunk in one parallel pass, merged exactly
+        JointMoments moments(img.JointStats(true));
+        CImg<double> covariance(NumBands, NumBands, 1, 1, 0);
+        cimg_forXY(covariance,x,y) covariance(x,y) = moments.Covariance(y, x);
 
         if (Options::Verbose() > 2) {
             cout << img.Basename() << " Spectral Covariance Matrix:" << endl;
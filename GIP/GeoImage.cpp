@@ -103,6 +103,15 @@ namespace gip {
         int index(BandIndex(name));
         return this->operator[](index);
     }
+
+    GeoImage GeoImage::Scratch(const GeoImage& image, GDALDataType datatype, int bsz) {
+        GeoImage scratch;
+        static_cast<GeoResource&>(scratch) = GeoResource::Scratch(image.XSize(), image.YSize(), bsz, datatype);
+        scratch.SetCoordinateSystem(image);
+        scratch.LoadBands();
+        return scratch;
+    }
+
     // Add a band (to the end)
     GeoImage& GeoImage::AddBand(GeoRaster band) { //, unsigned int bandnum) {
         string name = (band.Description() == "") ? to_string(_RasterBands.size()+1) : band.Description();
@@ -136,18 +145,120 @@ namespace gip {
     // Replaces all Inf or NaN pixels with NoDataValue
     GeoImage& GeoImage::FixBadPixels() {
         typedef float T;
-        ChunkSet chunks(XSize(),YSize());
+        ChunkSet chunks(BlockChunks());
+        unsigned int depth(PipelineDepth(chunks, sizeof(T)));
         for (unsigned int b=0;b<NumBands();b++) {
-            for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-                CImg<T> img = (*this)[b].ReadRaw<T>(chunks[iChunk]);
-                T nodata = (*this)[b].NoDataValue();
+            GeoRaster& band((*this)[b]);
+            T nodata = band.NoDataValue();
+            PipelineChunks< CImg<T>, CImg<T> >(chunks, [&](unsigned int, const iRect& chunk) {
+                return band.ReadRaw<T>(chunk);
+            }, [&](unsigned int, const iRect&, CImg<T>& img) {
                 cimg_for(img,ptr,T) if ( std::isinf(*ptr) || std::isnan(*ptr) ) *ptr = nodata;
-                (*this)[b].WriteRaw(img,chunks[iChunk]);
-            }
+                return img;
+            }, [&](unsigned int, const iRect& chunk, CImg<T>& img) {
+                band.WriteRaw(img,chunk);
+            }, depth);
         }
         return *this;
     }
 
+    CImg<float> GeoImage::Stats() const {
+        JointMoments moments(JointStats());
+        CImg<float> stats(6, NumBands());
+        for (unsigned int b=0; b<NumBands(); b++) {
+            const Moments& m(moments[b]);
+            bool any(m.Count() > 0);
+            stats(0,b) = any ? m.Min() : _RasterBands[b].MaxValue();
+            stats(1,b) = any ? m.Max() : _RasterBands[b].MinValue();
+            stats(2,b) = m.Mean();
+            stats(3,b) = m.StdDev();
+            stats(4,b) = m.Skewness();
+            stats(5,b) = m.Count();
+        }
+        return stats;
+    }
+
+    JointMoments GeoImage::JointStats(bool covariance) const {
+        // float is enough unless a band needs double (see GeoRaster::ComputeType)
+        bool single(true);
+        for (unsigned int b=0; b<NumBands(); b++) {
+            switch (_RasterBands[b].ComputeType()) {
+                case GDT_Byte:
+                case GDT_UInt16:
+                case GDT_Int16:
+                case GDT_Float32:
+                    break;
+                default: single = false;
+            }
+        }
+        return single ? _JointStats<float>(covariance) : _JointStats<double>(covariance);
+    }
+
+    template<class T> JointMoments GeoImage::_JointStats(bool covariance) const {
+        unsigned int nb(NumBands());
+        std::vector<T> nodata(nb);
+        for (unsigned int b=0; b<nb; b++) nodata[b] = _RasterBands[b].NoDataValue();
+        // every chunk of all bands read once, with one mask shared by all bands
+        return ReduceChunks(BlockChunks(), [&](unsigned int, const iRect& chunk) {
+            PooledBuffer<T> cube;
+            PooledBuffer<unsigned char> valid;
+            ReadInto(*cube, chunk);
+            size_t n(cube->width() * cube->height());
+            valid->assign(cube->width(), cube->height(), 1, 1, 1);
+            for (unsigned int b=0; b<nb; b++) {
+                const T* ptr(cube->data(0,0,0,b));
+                for (size_t i=0; i<n; i++) if (ptr[i] == nodata[b]) (*valid)[i] = 0;
+            }
+            JointMoments part(nb, covariance);
+            part.Add(cube->data(), n, n, valid->data());
+            return part;
+        }, [](JointMoments& total, const JointMoments& part) {
+            total.Merge(part);
+        }, JointMoments(nb, covariance));
+    }
+
+    CImg<double> GeoImage::SpectralMoments(iRect chunk, bool complete) const {
+        unsigned int nb(NumBands());
+        PooledBuffer<double> cube;
+        ReadInto(*cube, chunk);
+        size_t n(cube->width() * cube->height());
+        // channels are mean, stddev, min, max and count; stddev holds M2 until the end
+        CImg<double> stats(cube->width(), cube->height(), 1, 5, 0);
+        double *mean(stats.data(0,0,0,0)), *m2(stats.data(0,0,0,1)), *lo(stats.data(0,0,0,2)),
+            *hi(stats.data(0,0,0,3)), *count(stats.data(0,0,0,4));
+        // Welford's update, streaming through one band at a time
+        for (unsigned int b=0; b<nb; b++) {
+            const double* ptr(cube->data(0,0,0,b));
+            bool nodata(_RasterBands[b].NoData());
+            double nodatavalue(_RasterBands[b].NoDataValue());
+            for (size_t i=0; i<n; i++) {
+                double v(ptr[i]);
+                if (nodata && v == nodatavalue) continue;
+                double k(++count[i]);
+                if (k == 1) {
+                    lo[i] = v;
+                    hi[i] = v;
+                } else {
+                    lo[i] = std::min(lo[i], v);
+                    hi[i] = std::max(hi[i], v);
+                }
+                double delta(v - mean[i]);
+                mean[i] += delta / k;
+                m2[i] += delta * (v - mean[i]);
+            }
+        }
+        double nodata(_RasterBands[0].NoDataValue());
+        for (size_t i=0; i<n; i++) {
+            if (count[i] == 0 || (complete && count[i] < nb)) {
+                mean[i] = m2[i] = lo[i] = hi[i] = nodata;
+                count[i] = 0;
+            } else {
+                m2[i] = (count[i] > 1) ? std::sqrt(m2[i] / (count[i] - 1)) : nodata;
+            }
+        }
+        return stats;
+    }
+
     /*const GeoImage& GeoImage::ComputeStats() const {
         for (unsigned int b=0;b<NumBands();b++) _RasterBands[b].ComputeStats();
         return *this;
@@ -194,6 +305,9 @@ namespace gip {
             // Release current dataset, point to new one
             _GDALDataset.reset();
             _GDALDataset = _RasterBands[index]._GDALDataset;
+            _DatasetId = _RasterBands[index]._DatasetId;
+            _IOLock = _RasterBands[index]._IOLock;
+            _Handles = _RasterBands[index]._Handles;
         }
     }
 
@@ -21,6 +21,7 @@
 
 #include <gip/GeoRaster.h>
 #include <gip/GeoImage.h>
+#include <gip/StatsCache.h>
 
 using namespace std;
 
@@ -31,16 +32,15 @@ namespace gip {
         : GeoResource(image), _GDALRasterBand(image._GDALRasterBand),
               _Masks(image._Masks), _NoData(image._NoData),
               _ValidStats(image._ValidStats), _Stats(image._Stats),
-              _Functions(image._Functions) {}
+              _Functions(image._Functions), _Operands(image._Operands) {}
 
-    // Copy constructor
-    GeoRaster::GeoRaster(const GeoRaster& image, func f)
+    // Copy constructor, appending an operation
+    GeoRaster::GeoRaster(const GeoRaster& image, PixelOp op)
         : GeoResource(image), _GDALRasterBand(image._GDALRasterBand),
               _Masks(image._Masks), _NoData(image._NoData),
               _ValidStats(image._ValidStats), _Stats(image._Stats),
-              _Functions(image._Functions) {
-        //if (func.Function() != "") AddFunction(func);
-        _Functions.push_back(f);
+              _Functions(image._Functions), _Operands(image._Operands) {
+        _Functions.push_back(op);
         //std::cout << Basename() << ": GeoRaster copy (" << this << ")" << std::endl;
     }
 
@@ -56,6 +56,7 @@ namespace gip {
         _Stats = image._Stats;
         //_ValidSize = image._ValidSize;
         _Functions = image._Functions;
+        _Operands = image._Operands;
         //cout << _GeoImage->Basename() << ": " << ref << " references (GeoRaster Assignment)" << endl;
         return *this;
     }
@@ -85,91 +86,387 @@ namespace gip {
         return info.str();
     }
 
+    string GeoRaster::Signature() const {
+        // only files that can not change under us
+        if (_GDALDataset->GetAccess() != GA_ReadOnly || Format() == "MEM") return "";
+        boost::system::error_code ec;
+        boost::uintmax_t size(boost::filesystem::file_size(_Filename, ec));
+        if (ec) return "";
+        std::time_t mtime(boost::filesystem::last_write_time(_Filename, ec));
+        if (ec) return "";
+        std::stringstream sig;
+        sig.precision(17);
+        sig << boost::filesystem::absolute(_Filename).string() << ":" << size << ":" << mtime
+            << ":" << _GDALRasterBand->GetBand() << ":" << Gain() << ":" << Offset()
+            << ":" << NoData() << ":" << NoDataValue();
+        for (unsigned int i=0; i<_Functions.size(); i++) {
+            // generic functions can not be identified
+            if (!_Functions[i].Fused()) return "";
+            sig << ":f" << _Functions[i].code() << "," << _Functions[i].value() << "," << _Functions[i].Operand();
+        }
+        for (unsigned int i=0; i<_Operands.size(); i++) {
+            string operand(_Operands[i].Signature());
+            if (operand.empty()) return "";
+            sig << ":operand(" << operand << ")";
+        }
+        for (unsigned int i=0; i<_Masks.size(); i++) {
+            string mask(_Masks[i].Signature());
+            if (mask.empty()) return "";
+            sig << ":mask(" << mask << ")";
+        }
+        return sig.str();
+    }
+
+    bool GeoRaster::CachedStats(const string& query, CImg<float>& values) const {
+        if (!Options::StatsCache()) return false;
+        string sig(Signature());
+        if (sig.empty()) return false;
+        return StatsCache::Get(_Filename, sig + "|" + query, values);
+    }
+
+    void GeoRaster::CacheStats(const string& query, const CImg<float>& values) const {
+        if (!Options::StatsCache()) return;
+        string sig(Signature());
+        if (sig.empty()) return;
+        StatsCache::Put(_Filename, sig + "|" + query, values);
+    }
+
     //! Compute stats
     CImg<float> GeoRaster::Stats() const {
         if (_ValidStats) return _Stats;
+        if (Options::ApproxStats()) return ApproxStats().get_crop(0,5);
+        return ExactStats();
+    }
 
-        CImg<double> cimg;
-        double count(0), total(0), val;
-        double min(MaxValue()), max(MinValue());
-        ChunkSet chunks(XSize(),YSize());
-
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            cimg = Read<double>(chunks[iChunk]);
-            cimg_for(cimg,ptr,double) {
-                if (*ptr != NoDataValue()) {
-                    total += *ptr;
-                    count++;
-                    if (*ptr > max) max = *ptr;
-                    if (*ptr < min) min = *ptr;
-                }
+    //! Compute stats from every pixel
+    CImg<float> GeoRaster::ExactStats() const {
+        if (_ValidStats) return _Stats;
+        CImg<float> stats;
+        if (!CachedStats("stats", stats)) {
+            switch (ComputeType()) {
+                case GDT_Byte: stats = _ComputeStats<unsigned char>(); break;
+                case GDT_UInt16: stats = _ComputeStats<unsigned short>(); break;
+                case GDT_Int16: stats = _ComputeStats<short>(); break;
+                case GDT_UInt32: stats = _ComputeStats<unsigned int>(); break;
+                case GDT_Int32: stats = _ComputeStats<int>(); break;
+                case GDT_Float32: stats = _ComputeStats<float>(); break;
+                default: stats = _ComputeStats<double>();
             }
+            CacheStats("stats", stats);
         }
-        float mean = total/count;
-        total = 0;
-        double total3(0);
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            cimg = Read<double>(chunks[iChunk]);
-            cimg_for(cimg,ptr,double) {
-                if (*ptr != NoDataValue()) {
-                    val = *ptr-mean;
-                    total += (val*val);
-                    total3 += (val*val*val);
-                }
+        _Stats = stats;
+        _ValidStats = true;
+        return _Stats;
+    }
+
+    CImg<float> GeoRaster::ApproxStats(unsigned int samplesize) const {
+        if (Size() <= samplesize) return ExactStats().append(CImg<float>(1,1,1,1,0.0), 'x');
+        std::string query("approxstats " + to_string(samplesize));
+        CImg<float> stats;
+        if (CachedStats(query, stats)) return stats;
+
+        // coarsest overview that still has enough pixels
+        GDALRasterBand* overview(NULL);
+        if (_Masks.empty() && _Operands.empty()) {
+            for (int i=0; i<_GDALRasterBand->GetOverviewCount(); i++) {
+                GDALRasterBand* ov(_GDALRasterBand->GetOverview(i));
+                if (ov == NULL) continue;
+                double pixels((double)ov->GetXSize() * ov->GetYSize());
+                if (pixels >= samplesize && (overview == NULL || pixels < (double)overview->GetXSize() * overview->GetYSize()))
+                    overview = ov;
             }
         }
-        float var = total/count;
-        float stdev = std::sqrt(var);
-        float skew = (total3/count)/std::sqrt(var*var*var);
-        _Stats = CImg<float>(6,1,1,1,(float)min,(float)max,mean,stdev,skew,count);
-        _ValidStats = true;
+        if (overview != NULL) {
+            stats = _OverviewStats(overview);
+        } else {
+            switch (ComputeType()) {
+                case GDT_Byte: stats = _SampleStats<unsigned char>(samplesize); break;
+                case GDT_UInt16: stats = _SampleStats<unsigned short>(samplesize); break;
+                case GDT_Int16: stats = _SampleStats<short>(samplesize); break;
+                case GDT_UInt32: stats = _SampleStats<unsigned int>(samplesize); break;
+                case GDT_Int32: stats = _SampleStats<int>(samplesize); break;
+                case GDT_Float32: stats = _SampleStats<float>(samplesize); break;
+                default: stats = _SampleStats<double>(samplesize);
+            }
+        }
+        CacheStats(query, stats);
+        return stats;
+    }
 
-        return _Stats;
+    //! Stats of an overview, with the error of the mean of that many independent pixels
+    CImg<float> GeoRaster::_OverviewStats(GDALRasterBand* overview) const {
+        int xsize(overview->GetXSize()), ysize(overview->GetYSize());
+        if (Options::Verbose() > 3)
+            std::cout << Basename() << ": statistics from " << xsize << " x " << ysize << " overview" << std::endl;
+        double nodata(NoDataValue());
+        std::vector<const double*> operands;
+        ChunkSet chunks(xsize, ysize);
+        Moments moments;
+        PooledBuffer<double> img;
+        for (unsigned int i=0; i<chunks.Size(); i++) {
+            iRect chunk(chunks[i]);
+            img->assign(chunk.width(), chunk.height());
+            CPLErr err;
+            {
+                std::lock_guard<std::mutex> lock(IOLock());
+                err = overview->RasterIO(GF_Read, chunk.x0(), chunk.y0(), chunk.width(), chunk.height(),
+                    img->data(), chunk.width(), chunk.height(), GDT_Float64, 0, 0);
+            }
+            if (err != CE_None) {
+                std::stringstream err;
+                err << "error reading " << CPLGetLastErrorMsg();
+                throw std::runtime_error(err.str());
+            }
+            ApplyPixelOps(*img, _Functions, operands, NULL, Gain(), Offset(), NoData(), nodata);
+            moments.Add(img->data(), img->size(), true, nodata);
+        }
+        double count(moments.Count());
+        double scale((double)Size() / ((double)xsize * ysize));
+        return CImg<float>(7,1,1,1,
+            (float)(count > 0 ? moments.Min() : MaxValue()), (float)(count > 0 ? moments.Max() : MinValue()),
+            (float)moments.Mean(), (float)moments.StdDev(), (float)moments.Skewness(), (float)(count*scale),
+            (float)(moments.StdDev() / std::sqrt(count)));
+    }
+
+    //! Stats of blocks evenly spread over the band, with the standard error of the mean over blocks
+    template<class T> CImg<float> GeoRaster::_SampleStats(unsigned int samplesize) const {
+        // one chunk per GDAL block, so the sample is made of single blocks
+        Point<int> blocksize(BlockSize());
+        unsigned int nbx((XSize() + blocksize.x() - 1) / blocksize.x());
+        unsigned int nby((YSize() + blocksize.y() - 1) / blocksize.y());
+        ChunkSet chunks(BlockChunks(0, nbx*nby));
+        unsigned int numchunks(chunks.Size());
+        double blockpixels((double)blocksize.x() * blocksize.y());
+        // at least 2 blocks, for the standard error
+        unsigned int numsamples(std::min(numchunks, std::max(2u, (unsigned int)std::ceil(samplesize / blockpixels))));
+        // one block from every stratum of numchunks/numsamples consecutive blocks, at its middle
+        std::vector<bool> sampled(numchunks, false);
+        for (unsigned int i=0; i<numsamples; i++)
+            sampled[std::min(numchunks-1, (unsigned int)(((double)i + 0.5) * numchunks / numsamples))] = true;
+        double nodata(NoDataValue());
+
+        std::vector<Moments> parts;
+        double readpixels(0);
+        Moments moments = ReduceChunks(chunks, [&](unsigned int i, const iRect& chunk) {
+            Moments part;
+            if (!sampled[i]) return part;
+            PooledBuffer<T> pcimg;
+            CImg<T>& cimg(ReadInto(*pcimg, chunk));
+            part.Add(cimg.data(), cimg.size(), true, nodata);
+            return part;
+        }, [&](Moments& moments, const Moments& part) {
+            moments.Merge(part);
+            if (part.Count() > 0) parts.push_back(part);
+        }, Moments());
+        for (unsigned int i=0; i<numchunks; i++) if (sampled[i]) readpixels += chunks[i].area();
+        if (Options::Verbose() > 3)
+            std::cout << Basename() << ": statistics from " << numsamples << " of " << numchunks << " blocks" << std::endl;
+
+        // standard error of a ratio mean of a cluster sample
+        double count(moments.Count()), mean(moments.Mean()), error(0);
+        double m(parts.size());
+        if (m > 1) {
+            double nbar(count / m), sum(0);
+            for (unsigned int i=0; i<parts.size(); i++) {
+                double dev((parts[i].Count() / nbar) * (parts[i].Mean() - mean));
+                sum += dev*dev;
+            }
+            error = std::sqrt((1.0 - (double)numsamples/numchunks) * sum / (m * (m - 1)));
+        }
+        double scale((double)Size() / readpixels);
+        return CImg<float>(7,1,1,1,
+            (float)(count > 0 ? moments.Min() : MaxValue()), (float)(count > 0 ? moments.Max() : MinValue()),
+            (float)mean, (float)moments.StdDev(), (float)moments.Skewness(), (float)(count*scale), (float)error);
+    }
+
+    //! Compute stats reading data as type T
+    template<class T> CImg<float> GeoRaster::_ComputeStats() const {
+        ChunkSet chunks(BlockChunks());
+        double nodata(NoDataValue());
+
+        // moments of every chunk from a single read, merged in chunk order
+        Moments moments = ReduceChunks(chunks, [&](unsigned int, const iRect& chunk) {
+            PooledBuffer<T> pcimg;
+            CImg<T>& cimg(ReadInto(*pcimg, chunk));
+            Moments part;
+            part.Add(cimg.data(), cimg.size(), true, nodata);
+            return part;
+        }, [](Moments& moments, const Moments& part) {
+            moments.Merge(part);
+        }, Moments());
+
+        double count(moments.Count());
+        double min(count > 0 ? moments.Min() : MaxValue());
+        double max(count > 0 ? moments.Max() : MinValue());
+        return CImg<float>(6,1,1,1,(float)min,(float)max,(float)moments.Mean(),
+            (float)moments.StdDev(),(float)moments.Skewness(),(float)count);
     }
 
     float GeoRaster::Percentile(float p) const {
-        CImg<float> stats = Stats();
-        unsigned int bins(100);
-        CImg<float> hist = Histogram(bins,true) * 100;
-        CImg<float> xaxis(bins);
-        float interval( (stats(1)-stats(0))/((float)bins-1) );
-        for (unsigned int i=0;i<bins;i++) xaxis[i] = stats(0) + i * interval;
-        if (p == 0) return stats(0);
-        if (p == 99) return stats(1);
-        int ind(1);
-        while(hist[ind] < p) ind++;
-        float xind( (p-hist[ind-1])/(hist[ind]-hist[ind-1]) );
-        return xaxis.linear_atX(ind-1+xind);
+        return Percentiles(std::vector<float>(1, p))[0];
+    }
+
+    //! Compute percentiles
+    CImg<float> GeoRaster::Percentiles(std::vector<float> p, float error) const {
+        std::stringstream query;
+        query.precision(9);
+        query << "percentiles " << error;
+        for (unsigned int i=0; i<p.size(); i++) query << " " << p[i];
+        CImg<float> result;
+        if (CachedStats(query.str(), result)) return result;
+        switch (ComputeType()) {
+            case GDT_Byte: result = _ExactPercentiles<unsigned char>(p); break;
+            case GDT_UInt16: result = _ExactPercentiles<unsigned short>(p); break;
+            case GDT_Int16: result = _ExactPercentiles<short>(p); break;
+            case GDT_UInt32: result = _Percentiles<unsigned int>(p, error); break;
+            case GDT_Int32: result = _Percentiles<int>(p, error); break;
+            case GDT_Float32: result = _Percentiles<float>(p, error); break;
+            default: result = _Percentiles<double>(p, error);
+        }
+        CacheStats(query.str(), result);
+        return result;
+    }
+
+    //! Percentiles from a count of every possible value of T (8 or 16 bit integers)
+    template<class T> CImg<float> GeoRaster::_ExactPercentiles(std::vector<float> p) const {
+        double nodata(NoDataValue());
+        int lowest(std::numeric_limits<T>::lowest());
+        int range(std::numeric_limits<T>::max() - lowest + 1);
+        CImg<double> counts(range,1,1,1,0.0);
+        ForEachChunk< CImg<double> >(BlockChunks(), [&](unsigned int, const iRect& chunk) {
+            PooledBuffer<T> pcimg;
+            CImg<T>& cimg(ReadInto(*pcimg, chunk));
+            CImg<double> part(range,1,1,1,0.0);
+            cimg_for(cimg,ptr,T) if (*ptr != nodata) part[*ptr - lowest]++;
+            return part;
+        }, [&](unsigned int, const iRect&, CImg<double>& part) {
+            counts += part;
+        });
+
+        // value at fractional rank p/100 * (count-1), interpolated between neighbouring ranks
+        CImg<double> cumulative(counts);
+        for (int i=1; i<range; i++) cumulative[i] += cumulative[i-1];
+        double count(cumulative[range-1]);
+        CImg<float> result(p.size());
+        for (unsigned int i=0; i<p.size(); i++) {
+            if (count == 0) {
+                result[i] = std::numeric_limits<float>::quiet_NaN();
+                continue;
+            }
+            double rank(std::min(std::max(p[i]/100.0, 0.0), 1.0) * (count - 1));
+            double lo(std::floor(rank));
+            int vlo(std::upper_bound(cumulative.data(), cumulative.end(), lo) - cumulative.data());
+            int vhi(std::upper_bound(cumulative.data(), cumulative.end(), std::min(lo + 1, count - 1)) - cumulative.data());
+            result[i] = lowest + vlo + (rank - lo) * (vhi - vlo);
+        }
+        return result;
+    }
+
+    //! Percentiles estimated with a t-digest
+    template<class T> CImg<float> GeoRaster::_Percentiles(std::vector<float> p, float error) const {
+        double nodata(NoDataValue());
+        double compression(1.0 / std::max(error, 1e-5f));
+        TDigest digest(compression);
+        ForEachChunk<TDigest>(BlockChunks(), [&](unsigned int, const iRect& chunk) {
+            PooledBuffer<T> pcimg;
+            CImg<T>& cimg(ReadInto(*pcimg, chunk));
+            TDigest part(compression);
+            part.Add(cimg.data(), cimg.size(), true, nodata);
+            return part;
+        }, [&](unsigned int, const iRect&, TDigest& part) {
+            digest.Merge(part);
+        });
+        CImg<float> result(p.size());
+        for (unsigned int i=0; i<p.size(); i++) result[i] = digest.Quantile(p[i]/100.0);
+        return result;
     }
 
     //! Compute histogram
     CImg<float> GeoRaster::Histogram(int bins, bool cumulative) const {
-        CImg<double> cimg;
+        // the bin edges are part of the query, they are approximate with Options::ApproxStats
         CImg<float> stats = Stats();
-        CImg<float> hist(bins,1,1,1,0);
-        long numpixels(0);
+        std::stringstream query;
+        query.precision(9);
+        query << "histogram " << bins << " " << cumulative << " " << stats(0) << " " << stats(1);
+        CImg<float> hist;
+        if (CachedStats(query.str(), hist)) return hist;
+        switch (ComputeType()) {
+            case GDT_Byte: hist = _Histogram<unsigned char>(bins, cumulative, stats); break;
+            case GDT_UInt16: hist = _Histogram<unsigned short>(bins, cumulative, stats); break;
+            case GDT_Int16: hist = _Histogram<short>(bins, cumulative, stats); break;
+            case GDT_UInt32: hist = _Histogram<unsigned int>(bins, cumulative, stats); break;
+            case GDT_Int32: hist = _Histogram<int>(bins, cumulative, stats); break;
+            case GDT_Float32: hist = _Histogram<float>(bins, cumulative, stats); break;
+            default: hist = _Histogram<double>(bins, cumulative, stats);
+        }
+        CacheStats(query.str(), hist);
+        return hist;
+    }
+
+    //! Compute histogram reading data as type T
+    template<class T> CImg<float> GeoRaster::_Histogram(int bins, bool cumulative, const CImg<float>& stats) const {
         float nodata = NoDataValue();
-        ChunkSet chunks(XSize(),YSize());
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-            cimg = Read<double>(chunks[iChunk]);
-            cimg_for(cimg,ptr,double) {
+        ChunkSet chunks(BlockChunks());
+        // last bin holds the pixel count
+        CImg<double> counts = ReduceChunks(chunks, [&](unsigned int, const iRect& chunk) {
+            PooledBuffer<T> pcimg;
+            CImg<T>& cimg(ReadInto(*pcimg, chunk));
+            CImg<double> part(bins+1,1,1,1,0.0);
+            int ind;
+            cimg_for(cimg,ptr,T) {
                 if (*ptr != nodata) {
-                    hist[(unsigned int)( (*ptr-stats(0))*bins / (stats(1)-stats(0)) )]++;
-                    numpixels++;
+                    // the maximum value falls in the last bin
+                    ind = (int)( (*ptr-stats(0))*bins / (stats(1)-stats(0)) );
+                    part[std::max(0, std::min(ind, bins-1))]++;
+                    part[bins]++;
                 }
             }
-        }
-        hist/=numpixels;
+            return part;
+        }, [](CImg<double>& counts, const CImg<double>& part) {
+            counts += part;
+        }, CImg<double>(bins+1,1,1,1,0.0));
+        CImg<float> hist(counts.get_crop(0,bins-1));
+        hist/=counts[bins];
         if (cumulative) for (int i=1;i<bins;i++) hist[i] += hist[i-1];
         //if (Options::Verbose() > 3) hist.display_graph(0,3,1,"Pixel Value",stats(0),stats(1));
         return hist;
     }
 
     GeoRaster& GeoRaster::ApplyMask(CImg<uint8_t> mask, iRect chunk) {
-        CImg<double> cimg = ReadRaw<double>(chunk);
+        // raw data is read and written in the band's own type when NoData fits in it
+        double nodata(NoDataValue());
+        switch (DataType()) {
+            case GDT_Byte:
+                if (Representable<unsigned char>(nodata)) return _ApplyMask<unsigned char>(mask, chunk);
+                break;
+            case GDT_UInt16:
+                if (Representable<unsigned short>(nodata)) return _ApplyMask<unsigned short>(mask, chunk);
+                break;
+            case GDT_Int16:
+                if (Representable<short>(nodata)) return _ApplyMask<short>(mask, chunk);
+                break;
+            case GDT_UInt32:
+                if (Representable<unsigned int>(nodata)) return _ApplyMask<unsigned int>(mask, chunk);
+                break;
+            case GDT_Int32:
+                if (Representable<int>(nodata)) return _ApplyMask<int>(mask, chunk);
+                break;
+            case GDT_Float32:
+                if (Representable<float>(nodata)) return _ApplyMask<float>(mask, chunk);
+                break;
+            default: break;
+        }
+        return _ApplyMask<double>(mask, chunk);
+    }
+
+    //! Apply mask to raw data of type T
+    template<class T> GeoRaster& GeoRaster::_ApplyMask(const CImg<uint8_t>& mask, iRect chunk) {
+        PooledBuffer<T> pcimg;
+        CImg<T>& cimg(ReadRawInto(*pcimg, chunk));
         if (!mask.is_sameXY(cimg))
             throw std::runtime_error("mask wrong size for chunk " + to_string(chunk));
-        cimg_forXY(cimg,x,y) if (mask(x,y) == 0) cimg(x,y) = NoDataValue();
+        T nodata = NoDataValue();
+        cimg_forXY(cimg,x,y) if (mask(x,y) == 0) cimg(x,y) = nodata;
         WriteRaw(cimg, chunk);
         return *this;
     }
@@ -20,7 +20,11 @@
 ##############################################################################*/
 
 #include <gip/GeoResource.h>
+#include <gip/ThreadPool.h>
+#include <gip/ChunkCache.h>
 #include <boost/filesystem.hpp>
+#include <boost/weak_ptr.hpp>
+#include <atomic>
 
 // logging
 //#include <boost/log/core.hpp>
@@ -39,10 +43,20 @@ namespace gip {
     int Options::_Verbose(1);
     int Options::_NumCores(2);
     string Options::_WorkDir("/tmp/");
+    float Options::_QueueSize(256.0);
+    float Options::_CacheSize(0.0);
+    bool Options::_StatsCache(false);
+    bool Options::_ApproxStats(false);
+    float Options::_ScratchSize(1024.0);
+
+    unsigned long GeoResource::NewDatasetId() {
+        static std::atomic<unsigned long> next(1);
+        return next++;
+    }
 
     // Constructors
     GeoResource::GeoResource(string filename, bool update)
-        : _Filename(filename) {
+        : _Filename(filename), _DatasetId(NewDatasetId()), _IOLock(new std::mutex) {
 
         // read/write permissions
         GDALAccess access = update ? GA_Update : GA_ReadOnly;
@@ -60,6 +74,10 @@ namespace gip {
         }
         _GDALDataset.reset(ds);
 
+        // read-only files can be opened again by each worker thread for concurrent reads
+        if (ds->GetAccess() == GA_ReadOnly && Format() != "MEM")
+            _Handles.reset(new DatasetHandles);
+
         // boost logging test
         //BOOST_LOG_TRIVIAL(trace) << Basename() << ": GeoResource Open (use_count = " << _GDALDataset.use_count() << ")" << std::endl;
 
@@ -68,11 +86,11 @@ namespace gip {
     }
 
 
-    GeoResource::GeoResource(int xsz, int ysz, int bsz, GDALDataType datatype, string filename, dictionary options)
-        : _Filename(filename) {
+    GeoResource::GeoResource(int xsz, int ysz, int bsz, GDALDataType datatype, string filename, dictionary options, string format)
+        : _Filename(filename), _DatasetId(NewDatasetId()), _IOLock(new std::mutex) {
 
         // format, driver, and file extension
-        string format = Options::DefaultFormat();
+        if (format == "") format = Options::DefaultFormat();
         //if (format == "GTiff") options["COMPRESS"] = "LZW";
         GDALDriver *driver = GetGDALDriverManager()->GetDriverByName(format.c_str());
         // TODO check for null driver and create method
@@ -99,24 +117,101 @@ namespace gip {
     }
 
     GeoResource::GeoResource(const GeoResource& resource)
-        : _Filename(resource._Filename), _GDALDataset(resource._GDALDataset) {}
+        : _Filename(resource._Filename), _Scratch(resource._Scratch), _GDALDataset(resource._GDALDataset),
+          _DatasetId(resource._DatasetId), _IOLock(resource._IOLock), _Handles(resource._Handles) {}
 
     GeoResource& GeoResource::operator=(const GeoResource& resource) {
         if (this == &resource) return *this;
         _Filename = resource._Filename;
+        _Scratch = resource._Scratch;
         _GDALDataset = resource._GDALDataset;
+        _DatasetId = resource._DatasetId;
+        _IOLock = resource._IOLock;
+        _Handles = resource._Handles;
         return *this;
     }
 
     GeoResource::~GeoResource() {
         // flush GDALDataset if last open pointer
         if (_GDALDataset.unique()) {
+            ChunkCache::Instance().Purge(_DatasetId);
             _GDALDataset->FlushCache();
             //BOOST_LOG_TRIVIAL(trace) << Basename() << ": ~GeoResource (use_count = " << _GDALDataset.use_count() << ")" << std::endl;
             if (Options::Verbose() > 4) std::cout << Basename() << ": ~GeoResource (use_count = " << _GDALDataset.use_count() << ")" << std::endl;
         }
     }
 
+    //! Bytes of in-memory scratch datasets currently open
+    static double _ScratchBytes(0);
+    static std::mutex _ScratchLock;
+
+    bool GeoResource::ScratchSpace::Reserve(double size) {
+        std::lock_guard<std::mutex> lock(_ScratchLock);
+        if (_ScratchBytes + size > Options::ScratchSize() * 1024 * 1024) return false;
+        _ScratchBytes += size;
+        bytes = size;
+        return true;
+    }
+
+    GeoResource::ScratchSpace::~ScratchSpace() {
+        if (bytes > 0) {
+            std::lock_guard<std::mutex> lock(_ScratchLock);
+            _ScratchBytes -= bytes;
+        }
+        if (!filename.empty()) {
+            boost::system::error_code ec;
+            boost::filesystem::remove(filename, ec);
+            if (Options::Verbose() > 4) std::cout << filename.string() << ": removed scratch file" << std::endl;
+        }
+    }
+
+    GeoResource GeoResource::Scratch(int xsz, int ysz, int bsz, GDALDataType datatype) {
+        boost::shared_ptr<ScratchSpace> space(new ScratchSpace);
+        double size((double)xsz * ysz * bsz * GDALGetDataTypeSize(datatype) / 8);
+        dictionary options;
+        string filename, format;
+        if (space->Reserve(size)) {
+            filename = "scratch";
+            format = "MEM";
+        } else {
+            // spill to an uncompressed tiled file, reads and writes of blocks map straight onto it
+            filename = (path(Options::WorkDir()) / boost::filesystem::unique_path("gipscratch-%%%%-%%%%-%%%%.tif")).string();
+            format = "GTiff";
+            options["TILED"] = "YES";
+            options["SPARSE_OK"] = "TRUE";
+        }
+        if (Options::Verbose() > 3)
+            std::cout << "Scratch " << xsz << " x " << ysz << " x " << bsz << " dataset in " << format << std::endl;
+        GeoResource res(xsz, ysz, bsz, datatype, filename, options, format);
+        if (res._GDALDataset.get() == NULL) throw std::runtime_error("Error creating scratch dataset " + filename);
+        if (format != "MEM") space->filename = res._Filename;
+        res._Scratch = space;
+        return res;
+    }
+
+    GDALDataset* GeoResource::ThreadDataset() const {
+        // the calling thread owns the shared handle when not in a worker
+        if (!_Handles || !ThreadPool::InWorker()) return NULL;
+        std::lock_guard<std::mutex> lock(_Handles->lock);
+        unsigned long id(ThreadPool::WorkerId());
+        std::map<unsigned long, boost::shared_ptr<GDALDataset> >::const_iterator h(_Handles->handles.find(id));
+        if (h != _Handles->handles.end()) return h->second.get();
+        // a failed open is remembered as NULL so the shared handle is used from then on
+        GDALDataset* ds = (GDALDataset*)GDALOpen(_Filename.string().c_str(), GA_ReadOnly);
+        if (Options::Verbose() > 4)
+            std::cout << Basename() << ": opened handle for worker " << id << std::endl;
+        _Handles->handles[id].reset(ds);
+        // closed when the worker exits (unless all handles are gone by then)
+        boost::weak_ptr<DatasetHandles> handles(_Handles);
+        ThreadPool::AtWorkerExit([handles, id]() {
+            boost::shared_ptr<DatasetHandles> h(handles.lock());
+            if (!h) return;
+            std::lock_guard<std::mutex> lock(h->lock);
+            h->handles.erase(id);
+        });
+        return ds;
+    }
+
     // Info
     string GeoResource::Filename() const {
         return _Filename.string();
@@ -188,6 +283,20 @@ namespace gip {
         return ChunkSet(XSize(), YSize(), padding, numchunks);
     }
 
+    ChunkSet GeoResource::BlockChunks(unsigned int padding, unsigned int numchunks) const {
+        Point<int> blocksize(BlockSize());
+        return ChunkSet(XSize(), YSize(), padding, numchunks, blocksize.x(), blocksize.y());
+    }
+
+    Point<int> GeoResource::BlockSize() const {
+        int xblock(0), yblock(0);
+        if (_GDALDataset->GetRasterCount() > 0)
+            _GDALDataset->GetRasterBand(1)->GetBlockSize(&xblock, &yblock);
+        // no bands, treat every row as a block
+        if (xblock == 0 || yblock == 0) return Point<int>(XSize(), 1);
+        return Point<int>(xblock, yblock);
+    }
+
     // Metadata
     string GeoResource::Meta(string key) const {
         const char* item = GetGDALObject()->GetMetadataItem(key.c_str());
@@ -0,0 +1,123 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#include <gip/StatsCache.h>
+#include <gip/Utils.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <unistd.h>
+
+namespace gip {
+    using std::string;
+
+    std::mutex& StatsCache::Lock() {
+        static std::mutex lock;
+        return lock;
+    }
+
+    string StatsCache::Hash(const string& key) {
+        unsigned long long hash(14695981039346656037ULL);
+        for (unsigned int i=0; i<key.size(); i++) {
+            hash ^= (unsigned char)key[i];
+            hash *= 1099511628211ULL;
+        }
+        std::stringstream ss;
+        ss << std::hex << hash;
+        return ss.str();
+    }
+
+    bool StatsCache::Get(const boost::filesystem::path& file, const string& key, CImg<float>& values) {
+        string hash(Hash(key));
+        std::lock_guard<std::mutex> lock(Lock());
+        std::ifstream sidecar(Sidecar(file).string().c_str());
+        string line, id;
+        unsigned int n;
+        while (std::getline(sidecar, line)) {
+            std::istringstream entry(line);
+            if (!(entry >> id >> n) || id != hash) continue;
+            CImg<float> found(n);
+            bool complete(true);
+            for (unsigned int i=0; i<n && complete; i++) {
+                // read as text, strtod takes the nan and inf written for non-finite values
+                string token;
+                char* end(NULL);
+                if (entry >> token) found[i] = std::strtod(token.c_str(), &end);
+                complete = end != NULL && end != token.c_str() && *end == '\0';
+            }
+            if (!complete) continue;
+            values = found;
+            if (Options::Verbose() > 3)
+                std::cout << file.filename().string() << ": statistics read from " << Sidecar(file).filename().string() << std::endl;
+            return true;
+        }
+        return false;
+    }
+
+    void StatsCache::Put(const boost::filesystem::path& file, const string& key, const CImg<float>& values) {
+        string hash(Hash(key));
+        std::stringstream entry;
+        entry.precision(9);
+        entry << hash << " " << values.size();
+        cimg_for(values,ptr,float) {
+            // spelled out so Get can parse them back
+            if (std::isnan(*ptr)) entry << " nan";
+            else if (std::isinf(*ptr)) entry << (*ptr > 0 ? " inf" : " -inf");
+            else entry << " " << *ptr;
+        }
+
+        std::lock_guard<std::mutex> lock(Lock());
+        boost::filesystem::path sidecar(Sidecar(file));
+        // keep other entries, newest last
+        std::vector<string> lines;
+        {
+            std::ifstream in(sidecar.string().c_str());
+            string line, id;
+            while (std::getline(in, line)) {
+                std::istringstream old(line);
+                if ((old >> id) && id != hash) lines.push_back(line);
+            }
+        }
+        lines.push_back(entry.str());
+        unsigned int first(lines.size() > MaxEntries ? lines.size() - MaxEntries : 0);
+
+        // write a new file and rename it over the old one so readers never see a partial file
+        boost::filesystem::path tmp(sidecar.string() + "." + to_string(getpid()));
+        {
+            std::ofstream out(tmp.string().c_str());
+            for (unsigned int i=first; i<lines.size(); i++) out << lines[i] << "\n";
+            if (!out) {
+                if (Options::Verbose() > 2)
+                    std::cout << "Unable to write statistics to " << sidecar.string() << std::endl;
+                out.close();
+                boost::system::error_code ec;
+                boost::filesystem::remove(tmp, ec);
+                return;
+            }
+        }
+        boost::system::error_code ec;
+        boost::filesystem::rename(tmp, sidecar, ec);
+        if (ec) boost::filesystem::remove(tmp, ec);
+    }
+
+} // namespace gip
@@ -0,0 +1,134 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#include <atomic>
+#include <gip/ThreadPool.h>
+
+namespace gip {
+
+    // Set on worker threads so nested parallel loops run serially
+    static thread_local bool _InWorker(false);
+    // Id of the worker and the functions to run as it exits
+    static thread_local unsigned long _WorkerId(0);
+    static thread_local std::vector<ThreadPool::task>* _AtExit(NULL);
+    static std::atomic<unsigned long> _NextWorkerId(1);
+
+    ThreadPool::ThreadPool(unsigned int numthreads)
+        : _Pending(0), _Stop(false) {
+        if (numthreads == 0) numthreads = 1;
+        for (unsigned int i=0; i<numthreads; i++) {
+            _Queues.push_back(std::deque<task>());
+            _QueueLocks.push_back(boost::shared_ptr<std::mutex>(new std::mutex));
+        }
+        for (unsigned int i=0; i<numthreads; i++)
+            _Threads.push_back(std::thread(&ThreadPool::Work, this, i));
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(_Lock);
+            _Stop = true;
+        }
+        _Wake.notify_all();
+        for (unsigned int i=0; i<_Threads.size(); i++) _Threads[i].join();
+    }
+
+    boost::shared_ptr<ThreadPool> ThreadPool::Instance() {
+        static std::mutex lock;
+        static boost::shared_ptr<ThreadPool> pool;
+        std::lock_guard<std::mutex> guard(lock);
+        unsigned int numthreads(Options::NumCores() > 0 ? Options::NumCores() : 1);
+        if (!pool || pool->Size() != numthreads) {
+            if (Options::Verbose() > 2)
+                std::cout << "Starting thread pool with " << numthreads << " workers" << std::endl;
+            pool.reset(new ThreadPool(numthreads));
+        }
+        return pool;
+    }
+
+    bool ThreadPool::InWorker() {
+        return _InWorker;
+    }
+
+    unsigned long ThreadPool::WorkerId() {
+        return _WorkerId;
+    }
+
+    void ThreadPool::AtWorkerExit(task func) {
+        if (_AtExit) _AtExit->push_back(func);
+    }
+
+    void ThreadPool::Submit(task t, unsigned int hint) {
+        unsigned int q(hint % _Queues.size());
+        // counted before it is queued, so a worker can never take it before it is counted
+        {
+            std::lock_guard<std::mutex> lock(_Lock);
+            _Pending++;
+        }
+        {
+            std::lock_guard<std::mutex> lock(*_QueueLocks[q]);
+            _Queues[q].push_back(t);
+        }
+        _Wake.notify_one();
+    }
+
+    bool ThreadPool::Pop(unsigned int id, task& t) {
+        unsigned int n(_Queues.size());
+        for (unsigned int i=0; i<n; i++) {
+            unsigned int q((id + i) % n);
+            std::lock_guard<std::mutex> lock(*_QueueLocks[q]);
+            if (_Queues[q].empty()) continue;
+            // own queue from the front, steal from the back of others
+            if (q == id) {
+                t = _Queues[q].front();
+                _Queues[q].pop_front();
+            } else {
+                t = _Queues[q].back();
+                _Queues[q].pop_back();
+            }
+            std::lock_guard<std::mutex> pending(_Lock);
+            _Pending--;
+            return true;
+        }
+        return false;
+    }
+
+    void ThreadPool::Work(unsigned int id) {
+        _InWorker = true;
+        _WorkerId = _NextWorkerId++;
+        std::vector<task> atexit;
+        _AtExit = &atexit;
+        task t;
+        while (true) {
+            if (Pop(id, t)) {
+                t();
+                t = task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(_Lock);
+            _Wake.wait(lock, [this]() { return _Stop || _Pending > 0; });
+            if (_Stop && _Pending == 0) break;
+        }
+        for (unsigned int i=0; i<atexit.size(); i++) atexit[i]();
+        _AtExit = NULL;
+    }
+
+} // namespace gip
@@ -0,0 +1,84 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#ifndef GIP_BUFFERPOOL_H
+#define GIP_BUFFERPOOL_H
+
+#include <vector>
+#include <gip/gip_CImg.h>
+
+namespace gip {
+
+    //! Per-thread pool of CImg buffers, reused from chunk to chunk to avoid reallocation
+    /*!
+        Buffers are handed out by swapping, so acquiring and releasing never copies pixels.
+        Every acquire gets its own buffer, so nested users (e.g., masks of masks) do not clobber each other.
+    */
+    template<class T> class BufferPool {
+    public:
+        //! Take a buffer (contents undefined) from the calling thread's pool
+        static void Acquire(CImg<T>& img) {
+            std::vector< CImg<T> >& pool(Pool());
+            if (pool.empty()) {
+                img.assign();
+            } else {
+                img.swap(pool.back());
+                pool.pop_back();
+            }
+        }
+        //! Return a buffer to the calling thread's pool, img is left empty
+        static void Release(CImg<T>& img) {
+            std::vector< CImg<T> >& pool(Pool());
+            if (pool.size() < MaxBuffers && !img.is_empty() && !img.is_shared()) {
+                pool.push_back(CImg<T>());
+                pool.back().swap(img);
+            }
+            img.assign();
+        }
+    private:
+        //! Most buffers kept per thread and type
+        static const unsigned int MaxBuffers = 16;
+
+        static std::vector< CImg<T> >& Pool() {
+            static thread_local std::vector< CImg<T> > pool;
+            return pool;
+        }
+    };
+
+    //! Buffer taken from the BufferPool for the lifetime of this object
+    template<class T> class PooledBuffer {
+    public:
+        PooledBuffer() { BufferPool<T>::Acquire(_Img); }
+        ~PooledBuffer() { BufferPool<T>::Release(_Img); }
+
+        CImg<T>& operator*() { return _Img; }
+        CImg<T>* operator->() { return &_Img; }
+    private:
+        // not copyable
+        PooledBuffer(const PooledBuffer&);
+        PooledBuffer& operator=(const PooledBuffer&);
+
+        CImg<T> _Img;
+    };
+
+} // namespace gip
+
+#endif
@@ -0,0 +1,133 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#ifndef GIP_CHUNKCACHE_H
+#define GIP_CHUNKCACHE_H
+
+#include <map>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <tuple>
+#include <set>
+
+#include <boost/shared_ptr.hpp>
+
+#include <gdal_priv.h>
+#include <gip/Utils.h>
+#include <gip/geometry.h>
+
+namespace gip {
+
+    //! Process wide LRU cache of raw (decoded, unmasked) chunks
+    /*!
+        Entries are keyed by dataset serial number (see GeoResource), band number, rectangle and
+        data type, and the total size is kept under Options::CacheSize.  Writes invalidate
+        overlapping entries of the band, and closing a dataset purges all of its entries.
+
+        Copying every chunk read into the cache only pays off when chunks are read again, so
+        Options::CacheSize is 0 by default and algorithms that reread chunks turn the cache on
+        while they run with a ChunkCache::Scope.
+    */
+    class ChunkCache {
+    public:
+        //! Turns the cache on (with at least the given size in MB) while in scope
+        class Scope {
+        public:
+            explicit Scope(float size=256.0);
+            ~Scope();
+        private:
+            Scope(const Scope&);
+            Scope& operator=(const Scope&);
+            float _Size;
+        };
+
+        //! Get the process wide cache
+        static ChunkCache& Instance();
+
+        //! Size in bytes the cache may use (the larger of Options::CacheSize and any open Scope)
+        size_t Budget() const;
+        //! Determine if reads go through the cache
+        bool Enabled() const { return Budget() > 0; }
+
+        //! Current write epoch of a dataset, taken before reading data to be cached
+        unsigned long Epoch(unsigned long ds);
+        //! Copy a cached chunk into data, returning false on a miss
+        bool Get(unsigned long ds, int band, const Rect<int>& rect, GDALDataType type, void* data, size_t bytes);
+        //! Add a chunk read at the given epoch (dropped if the dataset was written since)
+        void Put(unsigned long ds, int band, const Rect<int>& rect, GDALDataType type, const void* data, size_t bytes, unsigned long epoch);
+        //! Drop entries of a band overlapping rect after it is written
+        void Invalidate(unsigned long ds, int band, const Rect<int>& rect);
+        //! Drop all entries of a dataset (when it is closed)
+        void Purge(unsigned long ds);
+        //! Drop all entries
+        void Clear();
+
+        //! Number of reads served from the cache
+        unsigned long Hits() const {
+            std::lock_guard<std::mutex> lock(_Lock);
+            return _Hits;
+        }
+        //! Number of reads not in the cache
+        unsigned long Misses() const {
+            std::lock_guard<std::mutex> lock(_Lock);
+            return _Misses;
+        }
+        //! Total size of cached chunks in bytes
+        size_t Bytes() const {
+            std::lock_guard<std::mutex> lock(_Lock);
+            return _Bytes;
+        }
+
+    private:
+        ChunkCache() : _Bytes(0), _Hits(0), _Misses(0) {}
+
+        //! dataset serial number, band, x0, y0, width, height, data type
+        typedef std::tuple<unsigned long, int, int, int, int, int, int> key;
+        typedef std::list<key> lru;
+        struct entry {
+            boost::shared_ptr< std::vector<unsigned char> > data;
+            lru::iterator age;
+        };
+
+        static key Key(unsigned long ds, int band, const Rect<int>& rect, GDALDataType type) {
+            return key(ds, band, rect.x0(), rect.y0(), rect.width(), rect.height(), type);
+        }
+        //! Remove entry (lock must be held)
+        void Erase(std::map<key, entry>::iterator e);
+        //! Evict least recently used entries until under budget (lock must be held)
+        void Trim(size_t budget);
+
+        mutable std::mutex _Lock;
+        std::map<key, entry> _Entries;
+        //! Most recently used at front
+        lru _Ages;
+        std::map<unsigned long, unsigned long> _Epochs;
+        //! Sizes (MB) of the open scopes
+        std::multiset<float> _Scopes;
+        size_t _Bytes;
+        unsigned long _Hits;
+        unsigned long _Misses;
+    };
+
+} // namespace gip
+
+#endif
@@ -0,0 +1,171 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#ifndef GIP_CHUNKPIPELINE_H
+#define GIP_CHUNKPIPELINE_H
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <utility>
+#include <algorithm>
+#include <memory>
+
+#include <gip/Utils.h>
+#include <gip/geometry.h>
+
+namespace gip {
+
+    //! Fixed capacity queue passing items between threads
+    /*!
+        Items are moved in and out, so queue owning pointers to pass large data without copying it.
+    */
+    template<class T> class BoundedQueue {
+    public:
+        explicit BoundedQueue(unsigned int capacity)
+            : _Capacity(std::max(capacity, 1u)), _Closed(false), _Aborted(false) {}
+
+        //! Move item into the queue, waiting for room (false if the queue was aborted)
+        bool Push(T& item) {
+            std::unique_lock<std::mutex> lock(_Lock);
+            _NotFull.wait(lock, [this]() { return _Aborted || _Items.size() < _Capacity; });
+            if (_Aborted) return false;
+            _Items.push_back(std::move(item));
+            _NotEmpty.notify_one();
+            return true;
+        }
+        //! Move the next item out of the queue, waiting for one (false once closed and drained, or aborted)
+        bool Pop(T& item) {
+            std::unique_lock<std::mutex> lock(_Lock);
+            _NotEmpty.wait(lock, [this]() { return _Aborted || _Closed || !_Items.empty(); });
+            if (_Aborted || _Items.empty()) return false;
+            item = std::move(_Items.front());
+            _Items.pop_front();
+            _NotFull.notify_one();
+            return true;
+        }
+        //! No more items will be pushed
+        void Close() {
+            std::lock_guard<std::mutex> lock(_Lock);
+            _Closed = true;
+            _NotEmpty.notify_all();
+        }
+        //! Drop all items and release all waiting threads
+        void Abort() {
+            std::lock_guard<std::mutex> lock(_Lock);
+            _Aborted = true;
+            _Items.clear();
+            _NotEmpty.notify_all();
+            _NotFull.notify_all();
+        }
+
+    private:
+        unsigned int _Capacity;
+        std::deque<T> _Items;
+        bool _Closed;
+        bool _Aborted;
+        std::mutex _Lock;
+        std::condition_variable _NotEmpty;
+        std::condition_variable _NotFull;
+    };
+
+    //! Number of chunks that fit in each pipeline queue given Options::QueueSize
+    /*!
+        bytesperpixel is the total size of a pixel for everything read (or written) per chunk,
+        the memory budget is split evenly between the read and write queues.
+    */
+    inline unsigned int PipelineDepth(const ChunkSet& chunks, unsigned int bytesperpixel) {
+        double maxarea(1);
+        for (unsigned int i=0; i<chunks.Size(); i++)
+            maxarea = std::max(maxarea, (double)chunks[i].get_Pad().area());
+        double chunkbytes(maxarea * std::max(bytesperpixel, 1u));
+        return std::max(1u, (unsigned int)(Options::QueueSize() * 1024 * 1024 / (2 * chunkbytes)));
+    }
+
+    //! Process chunks with reads running ahead and writes running behind the computation
+    /*!
+        read(iChunk, chunk) runs on a reader thread and returns an In, compute(iChunk, chunk, In&)
+        runs on the calling thread and returns an Out, and write(iChunk, chunk, Out&) runs on a writer
+        thread, in chunk order.  Up to depth chunks wait in each of the read and write queues, so
+        disk, decompression and computation overlap.  The first error raised is rethrown.
+    */
+    template<class In, class Out, class R, class F, class W>
+    void PipelineChunks(const ChunkSet& chunks, R read, F compute, W write, unsigned int depth) {
+        // chunk data is queued by pointer, so it is never copied between stages
+        typedef std::pair< unsigned int, std::unique_ptr<In> > InItem;
+        typedef std::pair< unsigned int, std::unique_ptr<Out> > OutItem;
+        BoundedQueue<InItem> reads(depth);
+        BoundedQueue<OutItem> writes(depth);
+        std::exception_ptr readerror, writeerror, error;
+
+        std::thread reader([&]() {
+            try {
+                for (unsigned int i=0; i<chunks.Size(); i++) {
+                    InItem item(i, std::unique_ptr<In>(new In(read(i, chunks[i]))));
+                    if (!reads.Push(item)) return;
+                }
+                reads.Close();
+            } catch(...) {
+                readerror = std::current_exception();
+                reads.Abort();
+                writes.Abort();
+            }
+        });
+        std::thread writer([&]() {
+            try {
+                OutItem item;
+                while (writes.Pop(item)) {
+                    write(item.first, chunks[item.first], *item.second);
+                    item.second.reset();
+                }
+            } catch(...) {
+                writeerror = std::current_exception();
+                writes.Abort();
+                reads.Abort();
+            }
+        });
+
+        try {
+            InItem item;
+            while (reads.Pop(item)) {
+                OutItem result(item.first, std::unique_ptr<Out>(new Out(compute(item.first, chunks[item.first], *item.second))));
+                item.second.reset();
+                if (!writes.Push(result)) break;
+            }
+            writes.Close();
+        } catch(...) {
+            error = std::current_exception();
+            reads.Abort();
+            writes.Abort();
+        }
+        reader.join();
+        writer.join();
+
+        if (readerror) std::rethrow_exception(readerror);
+        if (writeerror) std::rethrow_exception(writeerror);
+        if (error) std::rethrow_exception(error);
+    }
+
+} // namespace gip
+
+#endif
@@ -0,0 +1,83 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#ifndef GIP_EXPRESSION_H
+#define GIP_EXPRESSION_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace gip {
+
+    //! Arithmetic expression over named variables, compiled once and evaluated over arrays
+    /*!
+        Supports numbers, variable names (letters, digits and underscores, e.g., band names),
+        + - * / and ^ (power), unary minus, parentheses and the functions sqrt, abs, exp, log,
+        min(a,b) and max(a,b), e.g., "(NIR-RED)/(NIR+RED)".  The expression is compiled to a
+        postfix program that is evaluated a block of values at a time, so each operation is a
+        tight loop over the block rather than a tree walk per value.
+    */
+    class Expression {
+    public:
+        //! Compile expression, throwing std::runtime_error on a syntax error
+        Expression(std::string expr);
+
+        //! The expression as given
+        std::string String() const { return _String; }
+        //! Names of the variables used, in order of first use
+        const std::vector<std::string>& Variables() const { return _Variables; }
+
+        //! Evaluate over n values, vars[i] points to the n values of Variables()[i]
+        void Evaluate(const float* const* vars, size_t n, float* out) const;
+
+    private:
+        enum Code { Constant, Variable, Add, Subtract, Multiply, Divide, Power, Negate,
+                    Sqrt, Abs, Exp, Log, Min, Max };
+        struct Instruction {
+            Code code;
+            //! Constant value or variable index
+            float value;
+            unsigned int index;
+        };
+
+        //! Recursive descent parser, each level appends its postfix instructions
+        void ParseSum(size_t& pos);
+        void ParseProduct(size_t& pos);
+        void ParseUnary(size_t& pos);
+        void ParsePower(size_t& pos);
+        void ParseAtom(size_t& pos);
+        //! Skip whitespace and return next character (0 at end)
+        char Peek(size_t& pos) const;
+        void Error(std::string msg, size_t pos) const;
+        void Emit(Code code, float value=0, unsigned int index=0);
+
+        std::string _String;
+        std::vector<std::string> _Variables;
+        std::vector<Instruction> _Program;
+        //! Most blocks on the stack at once
+        unsigned int _Depth;
+        unsigned int _Size;
+    };
+
+} // namespace gip
+
+#endif
@@ -55,13 +55,17 @@ namespace gip {
     //GeoImage kmeans(const GeoImage&, std::string, int classes=5, int iterations=5, float threshold=1.0);
 
     //! Create indices in one pass: NDVI, EVI, LSWI, NDSI, BI {product, filename}
-    dictionary Indices(const GeoImage&, dictionary, dictionary=dictionary());
+    /*!
+        expressions defines additional products {product, expression} over band names,
+        e.g., {"ndvi2", "(NIR-RED)/(NIR+RED)"}, and overrides built-in products of the same name.
+    */
+    dictionary Indices(const GeoImage&, dictionary, dictionary=dictionary(), dictionary expressions=dictionary());
 
     //! Create output based on linear combinations of input
     GeoImage LinearTransform(const GeoImage&, std::string, CImg<float>);
 
-    //! Runs the RX Detector (RXD) anamoly detection algorithm
-    GeoImage RXD(const GeoImage&, std::string);
+    //! Runs the RX Detector (RXD) anamoly detection algorithm (in float32 if single is set)
+    GeoImage RXD(const GeoImage&, std::string, bool single=false);
 
     //! Calculate spectral statistics and output to new image
     GeoImage SpectralStatistics(const GeoImage&, std::string);
@@ -24,6 +24,8 @@
 
 #include <gip/GeoResource.h>
 #include <gip/GeoRaster.h>
+#include <gip/ChunkPipeline.h>
+#include <gip/Sampling.h>
 #include <stdint.h>
 
 namespace gip {
@@ -79,6 +81,14 @@ namespace gip {
             LoadBands();
         }
 
+        //! Create temporary image (same xsize, ysize, coordinate system) for intermediate results
+        /*!
+            The image is kept in memory (GDAL MEM) while the total of open scratch images fits in
+            Options::ScratchSize, otherwise it spills to a temporary file in Options::WorkDir.  The
+            storage is released when the last copy of the image (or of its bands) is destroyed.
+        */
+        static GeoImage Scratch(const GeoImage& image, GDALDataType datatype, int bsz);
+
         // Factory functions to support keywords in python bindings
         /*static GeoImage Open(string filename, bool update=true) {
             return GeoImage(filename, update);
@@ -242,24 +252,34 @@ namespace gip {
         //! \name File I/O
         //! Read raw chunk, across all bands
         template<class T> CImg<T> ReadRaw(iRect chunk=iRect()) const {
-            CImgList<T> images;
-            typename std::vector< GeoRaster >::const_iterator iBand;
-            for (iBand=_RasterBands.begin();iBand!=_RasterBands.end();iBand++) {
-                images.insert( iBand->ReadRaw<T>(chunk) );
-            }
-            //return images.get_append('c','p');
-            return images.get_append('v','p');
+            CImg<T> img;
+            ReadRawInto(img, chunk);
+            return img;
         }
 
         //! Read chunk, across all bands
         template<class T> CImg<T> Read(iRect chunk=iRect()) const {
-            CImgList<T> images;
-            typename std::vector< GeoRaster >::const_iterator iBand;
-            for (iBand=_RasterBands.begin();iBand!=_RasterBands.end();iBand++) {
-                images.insert( iBand->Read<T>(chunk) );
+            CImg<T> img;
+            ReadInto(img, chunk);
+            return img;
+        }
+
+        //! Read raw chunk of all bands straight into img (one band per channel)
+        /*!
+            Bands whose size differs from the image are read separately and copied in, with the
+            cube as large as the largest band and zero filled beyond the smaller ones.
+        */
+        template<class T> CImg<T>& ReadRawInto(CImg<T>& img, iRect chunk=iRect()) const;
+
+        //! Read chunk of all bands straight into img (one band per channel)
+        template<class T> CImg<T>& ReadInto(CImg<T>& img, iRect chunk=iRect()) const {
+            if (!_SameSizeBands(chunk)) return _ReadBandsInto(img, chunk, false);
+            ReadRawInto(img, chunk);
+            for (unsigned int b=0; b<NumBands(); b++) {
+                CImg<T> band(img.get_shared_channel(b));
+                _RasterBands[b].ApplyProcessing(band, chunk);
             }
-            //return images.get_append('c','p');
-            return images.get_append('v','p');
+            return img;
         }
 
         //! Write cube across all bands
@@ -281,64 +301,40 @@ namespace gip {
             return images;
         }
 
+        //! Statistics of every band from a single read, over pixels valid in all bands
+        /*!
+            Returns a table with a row per band of min, max, mean, stddev, skew and count.
+        */
+        CImg<float> Stats() const;
+        //! Joint moments of all bands, and their covariance if requested, from a single read
+        JointMoments JointStats(bool covariance=false) const;
+
+        //! Per-pixel mean, stddev, min, max and count across bands, one channel each, from a single read
+        /*!
+            With complete set only pixels with data in every band are reduced, otherwise each pixel
+            uses whichever bands have data.  Pixels left out get the first band's NoDataValue (and a
+            count of 0), as does the stddev of pixels with fewer than two bands.
+        */
+        CImg<double> SpectralMoments(iRect chunk=iRect(), bool complete=true) const;
+
         //! Calculate mean, stddev for chunk - must contain data for all bands
         CImgList<double> SpectralStatistics(iRect chunk=iRect()) const {
-            CImg<unsigned char> mask;
-            CImg<double> band, total, mean;
-            unsigned int iBand;
-            mask = DataMask({}, chunk);
-            double nodata = _RasterBands[0].NoDataValue();
-            for (iBand=0;iBand<NumBands();iBand++) {
-                band = _RasterBands[iBand].Read<double>(chunk).mul(mask);
-                if (iBand == 0) {
-                    total = band;
-                } else {
-                    total += band;
-                }
-            }
-            mean = total / NumBands();
-            for (iBand=0;iBand<NumBands();iBand++) {
-                band = _RasterBands[iBand].Read<double>(chunk).mul(mask);
-                if (iBand == 0) {
-                    total = (band - mean).pow(2);
-                } else {
-                    total += (band - mean).pow(2);
-                }
-            }
-            CImgList<double> stats(mean, (total / (NumBands()-1)).sqrt());
-            cimg_forXY(mask,x,y) { 
-                if (mask(x,y) == 0) {
-                    stats[0](x,y) = nodata;
-                    stats[1](x,y) = nodata; 
-                }
-            }
-            return stats;          
+            CImg<double> moments(SpectralMoments(chunk));
+            return CImgList<double>(moments.get_channel(0), moments.get_channel(1));
         }
 
         //! Mean (per pixel) of all bands, written to raster
         GeoRaster& Mean(GeoRaster& raster) const {
-            CImg<unsigned char> mask;
-            CImg<int> totalpixels;
-            CImg<double> band, total;
-            ChunkSet chunks(XSize(),YSize());
-            for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-                for (unsigned int iBand=0;iBand<NumBands();iBand++) {
-                    mask = _RasterBands[iBand].DataMask(chunks[iChunk]);
-                    band = _RasterBands[iBand].Read<double>(chunks[iChunk]).mul(mask);
-                    if (iBand == 0) {
-                        totalpixels = mask;
-                        total = band;
-                    } else {
-                        totalpixels += mask;
-                        total += band;
-                    }
-                }
-                total = total.div(totalpixels);
-                cimg_for(total,ptr,double) {
-                    if (*ptr != *ptr) *ptr = raster.NoDataValue();
-                }
-                raster.Write(total, chunks[iChunk]);
-            }
+            double nodata(raster.NoDataValue());
+            ForEachChunk< CImg<double> >(BlockChunks(), [&](unsigned int, const iRect& chunk) {
+                CImg<double> moments(SpectralMoments(chunk, false));
+                CImg<double> mean(moments.get_channel(0));
+                const double* count(moments.data(0,0,0,4));
+                cimg_foroff(mean,i) if (count[i] == 0) mean[i] = nodata;
+                return mean;
+            }, [&](unsigned int, const iRect& chunk, CImg<double>& mean) {
+                raster.Write(mean, chunk);
+            });
             return raster;
         }
 
@@ -442,7 +438,7 @@ namespace gip {
             CImg<unsigned char> cmask;
             CImg<T> cimg;
             long count = 0;
-            ChunkSet chunks(XSize(),YSize());
+            ChunkSet chunks(BlockChunks());
             for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
                 cmask = mask.Read<unsigned char>(chunks[iChunk]);
                 cimg_for(cmask,ptr,unsigned char) if (*ptr > 0) count++;
@@ -464,37 +460,89 @@ namespace gip {
             return pixels;
         }
 
-        //! Get a number of random pixel vectors (spectral vectors)
-        template<class T> CImg<T> GetRandomPixels(int NumPixels) const {
+        //! Get a number of random pixel vectors (spectral vectors), one row per pixel
+        /*!
+            All locations are drawn up front, uniformly or one per cell of a grid over the image if
+            stratified, and sorted by block so every block touched is read once for all bands.
+            Locations without data in every band are redrawn (uniformly, once a stratified cell has
+            failed several times).  A seed of 0 seeds from the system.
+        */
+        template<class T> CImg<T> GetRandomPixels(int NumPixels, bool stratified=false, unsigned int seed=0) const {
+            if (NumPixels < 0) throw std::runtime_error(Basename() + ": cannot sample a negative number of pixels");
+            const unsigned int maxrounds(100), stratifiedrounds(10);
             CImg<T> Pixels(NumBands(), NumPixels);
-            srand( time(NULL) );
-            bool badpix;
-            int p = 0;
-            while(p < NumPixels) {
-                int col = (double)rand()/RAND_MAX * (XSize()-1);
-                int row = (double)rand()/RAND_MAX * (YSize()-1);
-                T pix[1];
-                badpix = false;
-                for (unsigned int j=0; j<NumBands(); j++) {
-                    _RasterBands[j].GetGDALRasterBand()->RasterIO(GF_Read, col, row, 1, 1, &pix, 1, 1, type2GDALtype(typeid(T)), 0, 0);
-                    if (_RasterBands[j].NoData() && pix[0] == _RasterBands[j].NoDataValue()) {
-                        badpix = true;
-                    } else {
-                        Pixels(j,p) = pix[0];
-                    }
+            std::mt19937_64 rng(SamplerSeed(seed));
+            std::uniform_int_distribution<int> cols(0, XSize()-1), rows(0, YSize()-1);
+            std::uniform_real_distribution<double> unit(0, 1);
+            // grid of at least NumPixels cells with roughly the aspect of the image
+            int nx(std::max(1, (int)std::ceil(std::sqrt((double)NumPixels * XSize() / YSize()))));
+            int ny((NumPixels + nx - 1) / nx);
+            std::vector<unsigned int> pending(NumPixels);
+            for (int p=0; p<NumPixels; p++) pending[p] = p;
+            for (unsigned int round=0; !pending.empty(); round++) {
+                if (round == maxrounds)
+                    throw std::runtime_error(Basename() + ": too few pixels with data to sample");
+                std::vector<iPoint> points(NumPixels);
+                for (unsigned int i=0; i<pending.size(); i++) {
+                    unsigned int p(pending[i]);
+                    if (stratified && round < stratifiedrounds) {
+                        // spread the samples over all cells of the grid
+                        long cell(((long)p * nx * ny) / NumPixels);
+                        points[p] = iPoint(std::min(XSize()-1, (unsigned int)(((cell % nx) + unit(rng)) * XSize() / nx)),
+                                           std::min(YSize()-1, (unsigned int)(((cell / nx) + unit(rng)) * YSize() / ny)));
+                    } else points[p] = iPoint(cols(rng), rows(rng));
                 }
-                if (!badpix) p++;
+                std::vector<char> valid(NumPixels, 0);
+                _ReadPixels(Pixels, pending, points, valid);
+                std::vector<unsigned int> failed;
+                for (unsigned int i=0; i<pending.size(); i++) if (!valid[pending[i]]) failed.push_back(pending[i]);
+                pending.swap(failed);
             }
             return Pixels;
         }
 
+        //! Get a uniform sample of the pixel vectors with data in every band, one row per pixel
+        /*!
+            Reads the whole image once, keeping a reservoir of each chunk in parallel, and so
+            returns fewer than NumPixels rows only if the image has fewer pixels with data.
+            A seed of 0 seeds from the system.
+        */
+        template<class T> CImg<T> GetReservoirPixels(int NumPixels, unsigned int seed=0) const {
+            if (NumPixels < 0) throw std::runtime_error(Basename() + ": cannot sample a negative number of pixels");
+            unsigned int nb(NumBands());
+            uint64_t base(SamplerSeed(seed));
+            Reservoir< std::vector<T> > sample(ReduceChunks(BlockChunks(), [&](unsigned int iChunk, const iRect& chunk) {
+                // every chunk has its own generator, so the sample doesn't depend on the threads
+                std::mt19937_64 rng(base + 0x9E3779B97F4A7C15ULL * (iChunk + 1));
+                PooledBuffer<T> cube;
+                ReadInto(*cube, chunk);
+                size_t n(cube->width() * cube->height());
+                Reservoir< std::vector<T> > part(NumPixels);
+                for (size_t i=0; i<n; i++) {
+                    uint64_t key(rng());
+                    if (!part.Accepts(key) || !_Valid(*cube, i, n)) continue;
+                    std::vector<T> pixel(nb);
+                    for (unsigned int b=0; b<nb; b++) pixel[b] = (*cube)[b*n + i];
+                    part.Add(key, pixel);
+                }
+                return part;
+            }, [](Reservoir< std::vector<T> >& total, const Reservoir< std::vector<T> >& part) {
+                total.Merge(part);
+            }, Reservoir< std::vector<T> >(NumPixels)));
+            std::vector< std::vector<T> > items(sample.Items());
+            CImg<T> Pixels(nb, items.size());
+            for (unsigned int p=0; p<items.size(); p++)
+                for (unsigned int b=0; b<nb; b++) Pixels(b,p) = items[p][b];
+            return Pixels;
+        }
+
         //! Get a number of pixel vectors that are spectrally distant from each other
-        template<class T> CImg<T> GetPixelClasses(int NumClasses) const {
+        template<class T> CImg<T> GetPixelClasses(int NumClasses, unsigned int seed=0) const {
             int RandPixelsPerClass = 500;
             CImg<T> stats;
             CImg<T> ClassMeans(NumBands(), NumClasses);
             // Get Random Pixels
-            CImg<T> RandomPixels = GetRandomPixels<T>(NumClasses * RandPixelsPerClass);
+            CImg<T> RandomPixels = GetRandomPixels<T>(NumClasses * RandPixelsPerClass, false, seed);
             // First pixel becomes first class
             cimg_forX(ClassMeans,x) ClassMeans(x,0) = RandomPixels(x,0);
             for (int i=1; i<NumClasses; i++) {
@@ -529,19 +577,179 @@ namespace gip {
         //! Loads Raster Bands of this GDALDataset into _RasterBands vector
         void LoadBands();
 
+        //! Joint moments of all bands, reading data as T
+        template<class T> JointMoments _JointStats(bool covariance) const;
+
+        //! Determine if pixel i of a cube of n pixel planes has data in every band
+        template<class T> bool _Valid(const CImg<T>& cube, size_t i, size_t n) const {
+            for (unsigned int b=0; b<NumBands(); b++)
+                if (_RasterBands[b].NoData() && cube[b*n + i] == _RasterBands[b].NoDataValue()) return false;
+            return true;
+        }
+
+        //! Read pixel vectors at points[p] into rows p of pixels, flagging those with data in every band
+        /*!
+            Samples are sorted by block and each block touched is read (for all bands) once,
+            blocks in parallel.
+        */
+        template<class T> void _ReadPixels(CImg<T>& pixels, std::vector<unsigned int> samples,
+                const std::vector<iPoint>& points, std::vector<char>& valid) const {
+            Point<int> blocksize(BlockSize());
+            int nxblocks((XSize() + blocksize.x() - 1) / blocksize.x());
+            auto block = [&](unsigned int p) {
+                return (points[p].y() / blocksize.y()) * nxblocks + points[p].x() / blocksize.x();
+            };
+            std::sort(samples.begin(), samples.end(), [&](unsigned int a, unsigned int b) {
+                return block(a) < block(b);
+            });
+            TaskGroup tasks;
+            for (size_t first=0; first<samples.size(); ) {
+                size_t last(first);
+                while (last < samples.size() && block(samples[last]) == block(samples[first])) last++;
+                tasks.Submit([&, first, last]() {
+                    int x0((points[samples[first]].x() / blocksize.x()) * blocksize.x());
+                    int y0((points[samples[first]].y() / blocksize.y()) * blocksize.y());
+                    iRect chunk(x0, y0, std::min(blocksize.x(), (int)XSize() - x0), std::min(blocksize.y(), (int)YSize() - y0));
+                    PooledBuffer<T> cube;
+                    ReadInto(*cube, chunk);
+                    size_t n(chunk.width() * chunk.height());
+                    for (size_t s=first; s<last; s++) {
+                        unsigned int p(samples[s]);
+                        size_t i((points[p].y() - y0) * chunk.width() + points[p].x() - x0);
+                        if (!_Valid(*cube, i, n)) continue;
+                        for (unsigned int b=0; b<NumBands(); b++) pixels(b,p) = (*cube)[b*n + i];
+                        valid[p] = 1;
+                    }
+                }, first);
+                first = last;
+            }
+            tasks.Wait();
+        }
+
         // Convert vector of band descriptions to band indices
         std::vector<int> Descriptions2Indices(std::vector<std::string> bands) const;
 
+        //! Region read for chunk from a raster of the given size (all of it if chunk is not valid), clipped when padded
+        static iRect _ReadRect(unsigned int xsize, unsigned int ysize, iRect chunk) {
+            iRect extent(0, 0, xsize, ysize);
+            if (!chunk.valid()) return extent;
+            return (chunk.Padding() > 0) ? chunk.get_Pad().Intersect(extent) : chunk;
+        }
+
+        //! Every band reads a region of chunk the same size as the image does, so they fill one cube
+        bool _SameSizeBands(iRect chunk) const {
+            iRect rect(_ReadRect(XSize(), YSize(), chunk));
+            for (unsigned int b=0; b<NumBands(); b++) {
+                iRect brect(_ReadRect(_RasterBands[b].XSize(), _RasterBands[b].YSize(), chunk));
+                if (brect.width() != rect.width() || brect.height() != rect.height()) return false;
+            }
+            return true;
+        }
+
+        //! Read every band on its own and copy it into its channel, for bands of different sizes
+        template<class T> CImg<T>& _ReadBandsInto(CImg<T>& img, iRect chunk, bool raw) const {
+            int width(0), height(0);
+            for (unsigned int b=0; b<NumBands(); b++) {
+                iRect brect(_ReadRect(_RasterBands[b].XSize(), _RasterBands[b].YSize(), chunk));
+                width = std::max(width, brect.width());
+                height = std::max(height, brect.height());
+            }
+            img.assign(width, height, 1, NumBands(), 0);
+            PooledBuffer<T> band;
+            for (unsigned int b=0; b<NumBands(); b++) {
+                if (raw)
+                    _RasterBands[b].ReadRawInto(*band, chunk);
+                else _RasterBands[b].ReadInto(*band, chunk);
+                img.draw_image(0, 0, 0, b, *band);
+            }
+            return img;
+        }
+
+        //! All bands are full size bands of this dataset, so can be read in one RasterIO
+        bool SingleDataset() const {
+            for (unsigned int b=0; b<NumBands(); b++) {
+                if (_RasterBands[b]._GDALDataset != _GDALDataset) return false;
+                if (_RasterBands[b].XSize() != XSize() || _RasterBands[b].YSize() != YSize()) return false;
+            }
+            return NumBands() > 0;
+        }
+
     }; // class GeoImage
 
     // GeoImage template function definitions
+    template<class T> CImg<T>& GeoImage::ReadRawInto(CImg<T>& img, iRect chunk) const {
+        if (!_SameSizeBands(chunk)) return _ReadBandsInto(img, chunk, true);
+        iRect rect(chunk.valid() ? chunk : iRect(0,0,XSize(),YSize()));
+        if (rect.Padding() > 0) rect = rect.get_Pad().Intersect(iRect(0,0,XSize(),YSize()));
+        img.assign(rect.width(), rect.height(), 1, NumBands());
+
+        if (!SingleDataset()) {
+            // bands from different datasets are read one at a time into their channels
+            for (unsigned int b=0; b<NumBands(); b++) {
+                CImg<T> band(img.get_shared_channel(b));
+                _RasterBands[b].ReadRawInto(band, chunk);
+            }
+            return img;
+        }
+
+        std::vector<int> bandmap(NumBands());
+        for (unsigned int b=0; b<NumBands(); b++)
+            bandmap[b] = _RasterBands[b].GetGDALRasterBand()->GetBand();
+
+        // skip reading if every band is cached
+        ChunkCache& cache(ChunkCache::Instance());
+        bool usecache(cache.Enabled());
+        GDALDataType type(type2GDALtype(typeid(T)));
+        size_t bandbytes(rect.area()*sizeof(T));
+        bool cached(usecache);
+        for (unsigned int b=0; b<NumBands() && cached; b++)
+            cached = cache.Get(_DatasetId, bandmap[b], rect, type, img.data(0,0,0,b), bandbytes);
+
+        if (!cached) {
+            // one read of all bands, straight into the planar cube
+            unsigned long epoch(usecache ? cache.Epoch(_DatasetId) : 0);
+            CPLErr err;
+            {
+                GDALDataset* ds(ThreadDataset());
+                std::unique_lock<std::mutex> lock(IOLock(), std::defer_lock);
+                if (ds == NULL) {
+                    ds = _GDALDataset.get();
+                    lock.lock();
+                }
+                err = ds->RasterIO(GF_Read, rect.x0(), rect.y0(), rect.width(), rect.height(),
+                    img.data(), rect.width(), rect.height(), type,
+                    NumBands(), &bandmap[0], 0, 0, 0);
+            }
+            if (err != CE_None) {
+                std::stringstream err;
+                err << "error reading " << CPLGetLastErrorMsg();
+                throw std::runtime_error(err.str());
+            }
+            if (usecache) {
+                for (unsigned int b=0; b<NumBands(); b++)
+                    cache.Put(_DatasetId, bandmap[b], rect, type, img.data(0,0,0,b), bandbytes, epoch);
+            }
+        }
+        for (unsigned int b=0; b<NumBands(); b++) {
+            CImg<T> band(img.get_shared_channel(b));
+            _RasterBands[b].ApplyMasks(band, chunk);
+        }
+        return img;
+    }
+
     template<class T> GeoImage& GeoImage::Process() {
         // Create chunks
-        ChunkSet chunks(XSize(), YSize());
+        ChunkSet chunks(BlockChunks());
+        unsigned int depth(PipelineDepth(chunks, sizeof(T)));
         for (unsigned int i=0; i<NumBands(); i++) {
-            for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-                (*this)[i].Write((*this)[i].Read<T>(chunks[iChunk]),chunks[iChunk]);
-            }
+            GeoRaster& band((*this)[i]);
+            PipelineChunks< CImg<T>, CImg<T> >(chunks, [&](unsigned int, const iRect& chunk) {
+                return band.Read<T>(chunk);
+            }, [](unsigned int, const iRect&, CImg<T>& cimg) {
+                return cimg;
+            }, [&](unsigned int, const iRect& chunk, CImg<T>& cimg) {
+                band.Write(cimg, chunk);
+            }, depth);
             // clear functions after processing
             (*this)[i].ClearFunctions();
         }
@@ -26,6 +26,11 @@
 #include <boost/function.hpp>
 
 #include <gip/GeoResource.h>
+#include <gip/ThreadPool.h>
+#include <gip/BufferPool.h>
+#include <gip/ChunkCache.h>
+#include <gip/PixelOps.h>
+#include <gip/Statistics.h>
 #include <boost/bind.hpp>
 
 #include <iostream>
@@ -37,6 +42,7 @@
 #include <typeinfo>
 #include <chrono>
 #include <stdint.h>
+#include <limits>
 
 namespace gip {
     typedef Rect<int> iRect;
@@ -49,7 +55,7 @@ namespace gip {
     class GeoRaster : public GeoResource {
         friend class GeoImage;
     public:
-        typedef boost::function< CImg<double>& (CImg<double>&) > func;
+        typedef PixelOp::func func;
         //! \name Constructors/Destructors
         //! Constructor for new band
         GeoRaster(const GeoResource& georesource, int bandnum=1)
@@ -59,7 +65,8 @@ namespace gip {
         }
         //! Copy constructor
         GeoRaster(const GeoRaster& image);
-        GeoRaster(const GeoRaster& image, func f);
+        //! Copy with an operation appended to the processing chain
+        GeoRaster(const GeoRaster& image, PixelOp op);
         //! Assignment Operator
         GeoRaster& operator=(const GeoRaster& image);
         //! Destructor
@@ -73,6 +80,17 @@ namespace gip {
         unsigned int YSize() const { return _GDALRasterBand->GetYSize(); }
         //! Get GDALDatatype
         GDALDataType DataType() const { return _GDALRasterBand->GetRasterDataType(); }
+        //! Natural block size of the band
+        Point<int> BlockSize() const {
+            int xblock, yblock;
+            _GDALRasterBand->GetBlockSize(&xblock, &yblock);
+            return Point<int>(xblock, yblock);
+        }
+        //! Get chunkset of tiles aligned to the natural block size of the band
+        ChunkSet BlockChunks(unsigned int padding=0, unsigned int numchunks=0) const {
+            Point<int> blocksize(BlockSize());
+            return ChunkSet(XSize(), YSize(), padding, numchunks, blocksize.x(), blocksize.y());
+        }
         //! Output file info
         std::string Info(bool showstats=false) const;
 
@@ -218,37 +236,36 @@ namespace gip {
 
         GeoRaster& AddFunction(func f) {
             _ValidStats = false;
-            _Functions.push_back(f);
+            _Functions.push_back(PixelOp(f));
             return *this;
         }
         GeoRaster& ClearFunctions() {
             if (!_Functions.empty()) _ValidStats = false;
             _Functions.clear();
+            _Operands.clear();
             return *this;
         }
 
         //! \name Processing functions
         // Logical operators
         GeoRaster operator>(const double &val) const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::threshold, _1, val, false, true));
+            return GeoRaster(*this, PixelOp(PixelOp::Greater, val));
         }
         GeoRaster operator>=(const double &val) const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::threshold, _1, val, false, false));
+            return GeoRaster(*this, PixelOp(PixelOp::GreaterEqual, val));
         }
         GeoRaster operator<(const double &val) const {
-            GeoRaster r(*this, boost::bind(&CImg<double>::threshold, _1, val, false, false) );
-            return r.BXOR(1);
+            return GeoRaster(*this, PixelOp(PixelOp::Less, val));
         }
         GeoRaster operator<=(const double &val) const {
-            GeoRaster r(*this, boost::bind(&CImg<double>::threshold, _1, val, false, true));
-            return r.BXOR(1);
+            return GeoRaster(*this, PixelOp(PixelOp::LessEqual, val));
         }
         GeoRaster operator==(const double &val) const {
-            return GeoRaster(*this, boost::bind(boost::mem_fn<CImg<double>&,CImg<double>,const double&>(&CImg<double>::operator==), _1, val));
+            return GeoRaster(*this, PixelOp(PixelOp::Equal, val));
         }        
         //! Bitwise XOR
         GeoRaster BXOR(const double &val) const {
-            return GeoRaster(*this, boost::bind(boost::mem_fn<CImg<double>&,CImg<double>,const double&>(&CImg<double>::operator^=), _1, val) );
+            return GeoRaster(*this, PixelOp(PixelOp::BXOR, val));
         }
 
         //! \name Convolution functions
@@ -259,98 +276,141 @@ namespace gip {
 
         // Arithmetic
         GeoRaster operator+(const double &val) const {
-            return GeoRaster(*this, boost::bind(boost::mem_fn<CImg<double>&,CImg<double>,const double&>(&CImg<double>::operator+=), _1, val));
+            return GeoRaster(*this, PixelOp(PixelOp::Add, val));
         }
         GeoRaster operator-(const double &val) const {
-            return GeoRaster(*this, boost::bind(boost::mem_fn<CImg<double>&,CImg<double>,const double&>(&CImg<double>::operator-=), _1, val));
+            return GeoRaster(*this, PixelOp(PixelOp::Subtract, val));
         }
         GeoRaster operator*(const double &val) const {
-            return GeoRaster(*this, boost::bind(boost::mem_fn<CImg<double>&,CImg<double>,const double&>(&CImg<double>::operator*=), _1, val));
+            return GeoRaster(*this, PixelOp(PixelOp::Multiply, val));
         }
         GeoRaster operator/(const double &val) const {
-            return GeoRaster(*this, boost::bind(boost::mem_fn<CImg<double>&,CImg<double>,const double&>(&CImg<double>::operator/=), _1, val));
+            return GeoRaster(*this, PixelOp(PixelOp::Divide, val));
+        }
+        //! \name Band math between rasters
+        //! These are lazy: the operand is read and combined chunk by chunk when this raster is read.
+        //! Pixels that are NoData in either raster are NoData in the result.
+        GeoRaster operator+(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::Add);
+        }
+        GeoRaster operator-(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::Subtract);
+        }
+        GeoRaster operator*(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::Multiply);
+        }
+        GeoRaster operator/(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::Divide);
+        }
+        GeoRaster operator>(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::Greater);
+        }
+        GeoRaster operator>=(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::GreaterEqual);
         }
+        GeoRaster operator<(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::Less);
+        }
+        GeoRaster operator<=(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::LessEqual);
+        }
+        GeoRaster operator==(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::Equal);
+        }
+        //! Pointwise max of two rasters
+        GeoRaster max(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::Max);
+        }
+        //! Pointwise min of two rasters
+        GeoRaster min(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::Min);
+        }
+        //! Pointwise exponent by another raster
+        GeoRaster pow(const GeoRaster& raster) const {
+            return Combine(raster, PixelOp::Pow);
+        }
+
         //friend GeoRaster operator/(const double &val, const GeoRaster& raster) {
         //    return raster.pow(-1)*val;
         //}
         //! Pointwise max operator
         GeoRaster max(const double &val) const {
-            return GeoRaster(*this, boost::bind(boost::mem_fn<CImg<double>&,CImg<double>,const double>(&CImg<double>::max), _1, val));
+            return GeoRaster(*this, PixelOp(PixelOp::Max, val));
         }
         //! Pointwise min operator
         GeoRaster min(const double &val) const {
-            return GeoRaster(*this, boost::bind(boost::mem_fn<CImg<double>&,CImg<double>,const double>(&CImg<double>::min), _1, val));
+            return GeoRaster(*this, PixelOp(PixelOp::Min, val));
         }
 
         //! Exponent
         GeoRaster pow(const double &val) const {
-            return GeoRaster(*this, boost::bind(boost::mem_fn<CImg<double>&,CImg<double>,const double>(&CImg<double>::pow), _1, val));
+            return GeoRaster(*this, PixelOp(PixelOp::Pow, val));
         }
         //! Square root
         GeoRaster sqrt() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::sqrt, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Sqrt));
         }
         //! Natural logarithm
         GeoRaster log() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::log, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Log));
         }
         //! Log (base 10)
         GeoRaster log10() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::log10, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Log10));
         }
         //! Exponential
         GeoRaster exp() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::exp, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Exp));
         }
 
         //! Absolute value
         GeoRaster abs() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::abs, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Abs));
         }
         //! Compute sign (-1 if < 0, +1 if > 0, 0 if 0)
         GeoRaster sign() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::sign, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Sign));
         }
 
         // Cosine
         GeoRaster cos() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::cos, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Cos));
         }
         //! Sine
         GeoRaster sin() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::sin, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Sin));
         }
         //! Tangent
         GeoRaster tan() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::tan, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Tan));
         }
         //! arccosine
         GeoRaster acos() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::acos, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Acos));
         }
         //! arccosine
         GeoRaster asin() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::asin, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Asin));
         }
         //! arctangent
         GeoRaster atan() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::atan, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Atan));
         }
         //! Hyperbolic cosine
         GeoRaster cosh() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::cosh, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Cosh));
         }
         //! Hyperbolic sine
         GeoRaster sinh() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::sinh, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Sinh));
         }
         //! Hyperbolic tagent
         GeoRaster tanh() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::tanh, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Tanh));
         }
         //! Sinc
         GeoRaster sinc() const {
-            return GeoRaster(*this, boost::bind(&CImg<double>::sinc, _1));
+            return GeoRaster(*this, PixelOp(PixelOp::Sinc));
         }
 
 
@@ -359,11 +419,33 @@ namespace gip {
         //double Max() const { return (GetGDALStats())[1]; }
         //double Mean() const { return (GetGDALStats())[2]; }
         //double StdDev() const { return (GetGDALStats())[3]; }
+        //! Statistics: min, max, mean, stddev, skew, count (approximate if Options::ApproxStats)
+        /*!
+            With Options::ApproxStats set everything built on Stats() is approximate too: the
+            statistics shown by Info, the bin edges of Histogram and the thermal thresholds of ACCA.
+            GeoImage::Stats and JointStats (used by RXD and SpectralCovariance) and Percentiles
+            always read every pixel.
+        */
         CImg<float> Stats() const;
+        //! Approximate statistics from an overview or a sample of about samplesize pixels
+        /*!
+            Uses the coarsest overview with at least samplesize pixels if there is one (and no masks or
+            raster operands, which have no overviews), otherwise reads blocks evenly spread over the
+            band.  Returns min, max, mean, stddev, skew, count (estimated for the whole band) and the
+            standard error of the mean.
+        */
+        CImg<float> ApproxStats(unsigned int samplesize=1000000) const;
 
         CImg<float> Histogram(int bins=100, bool cumulative=false) const;
 
+        //! Value at percentile p (0-100)
         float Percentile(float p) const;
+        //! Values at many percentiles (0-100) from a single pass
+        /*!
+            8 and 16 bit integer data are counted exactly, other data is summarized with a t-digest
+            whose rank error is roughly error (as a fraction), smallest at the tails.
+        */
+        CImg<float> Percentiles(std::vector<float> p, float error=0.005) const;
 
         // TODO - If RAW then can use GDAL Statistics, but compare speeds
         // Compute Statistics
@@ -382,6 +464,10 @@ namespace gip {
         //! \name File I/O
         template<class T> CImg<T> ReadRaw(iRect chunk=iRect()) const;
         template<class T> CImg<T> Read(iRect chunk=iRect()) const;
+        //! Read raw chunk directly into img, reusing its buffer if already the right size
+        template<class T> CImg<T>& ReadRawInto(CImg<T>& img, iRect chunk=iRect()) const;
+        //! Read chunk directly into img, reusing its buffer if already the right size
+        template<class T> CImg<T>& ReadInto(CImg<T>& img, iRect chunk=iRect()) const;
         template<class T> GeoRaster& WriteRaw(CImg<T> img, iRect chunk=iRect());
         template<class T> GeoRaster& Write(CImg<T> img, iRect chunk=iRect());
         template<class T> GeoRaster& Process(GeoRaster& raster);
@@ -476,9 +562,10 @@ namespace gip {
         //! Statistics
         mutable CImg<double> _Stats;
 
-        //! List of processing functions to apply on reads (in class GeoProcess)
-        //std::vector< boost::function< CImg<double>& (CImg<double>&) > > _Functions;
-        std::vector<func> _Functions;
+        //! Chain of processing operations to apply on reads
+        std::vector<PixelOp> _Functions;
+        //! Rasters used as operands by the processing chain
+        std::vector< GeoRaster > _Operands;
 
     private:
         //! Default constructor - private so not callable
@@ -499,17 +586,105 @@ namespace gip {
         }
 
         template<class T> inline CImg<unsigned char> _Mask(T val, iRect chunk=iRect()) const {
-            CImg<T> img = ReadRaw<T>(chunk);
-            CImg<unsigned char> mask(img.width(),img.height(),1,1,0);
-            cimg_forXY(img,x,y) if (img(x,y) == val) mask(x,y) = 1;
+            PooledBuffer<T> img;
+            ReadRawInto(*img, chunk);
+            CImg<unsigned char> mask(img->width(),img->height(),1,1,0);
+            cimg_forXY(*img,x,y) if ((*img)(x,y) == val) mask(x,y) = 1;
             return mask;
         }
 
+        //! True if val can be stored in type T without change
+        template<class T> static bool Representable(double val) {
+            return val >= (double)std::numeric_limits<T>::lowest() && val <= (double)std::numeric_limits<T>::max()
+                && (double)(T)val == val;
+        }
+
+        //! Data type to read the band as when computing on it
+        /*!
+            Values are used in the band's own type when reads return raw values (no gain, offset or
+            functions) and masked pixels can be set to NoData in it.  Otherwise float32 is used for
+            bands of 16 bits or less and double for anything larger.
+        */
+        GDALDataType ComputeType() const {
+            GDALDataType type(DataType());
+            if (Gain() == 1.0 && Offset() == 0.0 && _Functions.empty()) {
+                double nodata(NoDataValue());
+                bool fits(true);
+                if (!_Masks.empty()) {
+                    switch (type) {
+                        case GDT_Byte: fits = Representable<unsigned char>(nodata); break;
+                        case GDT_UInt16: fits = Representable<unsigned short>(nodata); break;
+                        case GDT_Int16: fits = Representable<short>(nodata); break;
+                        case GDT_UInt32: fits = Representable<unsigned int>(nodata); break;
+                        case GDT_Int32: fits = Representable<int>(nodata); break;
+                        case GDT_Float32: fits = Representable<float>(nodata); break;
+                        default: break;
+                    }
+                }
+                if (fits) return type;
+            }
+            switch (type) {
+                case GDT_Byte:
+                case GDT_UInt16:
+                case GDT_Int16:
+                case GDT_Float32:
+                    return GDT_Float32;
+                default: return GDT_Float64;
+            }
+        }
+
+        //! Identity of the values read (file, band, processing and masks), empty if unknown
+        std::string Signature() const;
+        //! Get statistics stored on disk for a query on this raster (if Options::StatsCache)
+        bool CachedStats(const std::string& query, CImg<float>& values) const;
+        //! Store statistics on disk for a query on this raster (if Options::StatsCache)
+        void CacheStats(const std::string& query, const CImg<float>& values) const;
+
+        //! Compute stats, reading data as T
+        template<class T> CImg<float> _ComputeStats() const;
+        //! Statistics from every pixel
+        CImg<float> ExactStats() const;
+        //! Approximate stats from an overview band
+        CImg<float> _OverviewStats(GDALRasterBand* overview) const;
+        //! Approximate stats from a sample of blocks, reading data as T
+        template<class T> CImg<float> _SampleStats(unsigned int samplesize) const;
+        //! Compute histogram with bins spanning stats(0) to stats(1), reading data as T
+        template<class T> CImg<float> _Histogram(int bins, bool cumulative, const CImg<float>& stats) const;
+        //! Compute exact percentiles of 8 or 16 bit integer data read as T
+        template<class T> CImg<float> _ExactPercentiles(std::vector<float> p) const;
+        //! Estimate percentiles of data read as T
+        template<class T> CImg<float> _Percentiles(std::vector<float> p, float error) const;
+        //! Apply mask to raw data read as T
+        template<class T> GeoRaster& _ApplyMask(const CImg<uint8_t>& mask, iRect chunk);
+
+        //! Copy of this raster with a binary operation on another raster appended to the chain
+        GeoRaster Combine(const GeoRaster& raster, PixelOp::Code code) const {
+            if (raster.XSize() != XSize() || raster.YSize() != YSize())
+                throw std::runtime_error(Basename() + " and " + raster.Basename() + " differ in size");
+            GeoRaster r(*this);
+            r._Operands.push_back(raster);
+            r._Functions.push_back(PixelOp::Binary(code, r._Operands.size()-1));
+            r._ValidStats = false;
+            return r;
+        }
+
+        //! Set pixels masked out by any of the masks to NoData
+        template<class T> void ApplyMasks(CImg<T>& img, iRect chunk) const;
+        //! Apply gain/offset and processing functions to raw data, keeping NoData
+        template<class T> void ApplyProcessing(CImg<T>& img, iRect chunk) const;
+
     }; //class GeoImage
 
     //! \name File I/O
     //! Read raw chunk given bounding box
     template<class T> CImg<T> GeoRaster::ReadRaw(iRect chunk) const {
+        CImg<T> img;
+        ReadRawInto(img, chunk);
+        return img;
+    }
+
+    //! Read raw chunk straight into the buffer of img
+    template<class T> CImg<T>& GeoRaster::ReadRawInto(CImg<T>& img, iRect chunk) const {
         if (!chunk.valid()) chunk = Rect<int>(0,0,XSize(),YSize());
         if (chunk.Padding() > 0) chunk = chunk.Pad().Intersect(Rect<int>(0,0,XSize(),YSize()));
 
@@ -517,72 +692,71 @@ namespace gip {
         int width = chunk.width();
         int height = chunk.height();
 
-        T* ptrPixels = new T[width*height];
-        CPLErr err = _GDALRasterBand->RasterIO(GF_Read, chunk.x0(), chunk.y0(), width, height, 
-            ptrPixels, width, height, type2GDALtype(typeid(T)), 0, 0);
-        if (err != CE_None) {
-            std::stringstream err;
-            err << "error reading " << CPLGetLastErrorMsg();
-            throw std::runtime_error(err.str());
+        img.assign(width, height);
+
+        // Repeat reads of a chunk come from the cache
+        ChunkCache& cache(ChunkCache::Instance());
+        bool usecache(cache.Enabled());
+        GDALDataType type(type2GDALtype(typeid(T)));
+        int bandnum(_GDALRasterBand->GetBand());
+        size_t bytes(img.size()*sizeof(T));
+        if (!usecache || !cache.Get(_DatasetId, bandnum, chunk, type, img.data(), bytes)) {
+            unsigned long epoch(usecache ? cache.Epoch(_DatasetId) : 0);
+            CPLErr err;
+            {
+                // use this thread's own handle if there is one, otherwise lock the shared one
+                GDALRasterBand* band(_GDALRasterBand);
+                GDALDataset* ds(ThreadDataset());
+                std::unique_lock<std::mutex> lock(IOLock(), std::defer_lock);
+                if (ds != NULL)
+                    band = ds->GetRasterBand(bandnum);
+                else lock.lock();
+                err = band->RasterIO(GF_Read, chunk.x0(), chunk.y0(), width, height, 
+                    img.data(), width, height, type, 0, 0);
+            }
+            if (err != CE_None) {
+                std::stringstream err;
+                err << "error reading " << CPLGetLastErrorMsg();
+                throw std::runtime_error(err.str());
+            }
+            if (usecache) cache.Put(_DatasetId, bandnum, chunk, type, img.data(), bytes, epoch);
         }
-        CImg<T> img(ptrPixels,width,height);
 
+        ApplyMasks(img, chunk);
+        return img;
+    }
+
+    //! Apply masks to a chunk
+    template<class T> void GeoRaster::ApplyMasks(CImg<T>& img, iRect chunk) const {
         // Apply all masks TODO - cmask need to be float ?
         if (_Masks.size() > 0) {
             if (Options::Verbose() > 3 && (chunk.p0()==iPoint(0,0)))
                 std::cout << Basename() << ": Applying " << _Masks.size() << " masks" << std::endl;
-            CImg<float> cmask(_Masks[0].Read<float>(chunk));
+            PooledBuffer<float> cmask, mask;
+            _Masks[0].ReadInto(*cmask, chunk);
             for (unsigned int i=1; i<_Masks.size(); i++) {
-                cmask.mul(_Masks[i].Read<float>(chunk));
+                cmask->mul(_Masks[i].ReadInto(*mask, chunk));
             }
             cimg_forXY(img,x,y) {
-                if (cmask(x,y) != 1) img(x,y) = NoDataValue();
+                if ((*cmask)(x,y) != 1) img(x,y) = NoDataValue();
             }
         }
-
-        delete ptrPixels;
-        return img;
     }
 
     //! Retrieve a piece of the image as a CImg
     template<class T> CImg<T> GeoRaster::Read(iRect chunk) const {
-        auto start = std::chrono::system_clock::now();
-
-        CImg<T> img(ReadRaw<T>(chunk));
-        CImg<T> imgorig(img);
+        CImg<T> img;
+        ReadInto(img, chunk);
+        return img;
+    }
 
-        bool updatenodata = false;
-        // Convert data to radiance (if not raw requested)
-        if (Gain() != 1.0 || Offset() != 0.0) {
-            img = Gain() * img + Offset();
-            // Update NoData now so applied functions have proper NoData value set (?)
-            if (NoData()) {
-                cimg_forXY(img,x,y) {
-                    if (imgorig(x,y) == NoDataValue()) img(x,y) = NoDataValue();
-                }
-            }
-        }
+    //! Retrieve a piece of the image straight into the buffer of img
+    template<class T> CImg<T>& GeoRaster::ReadInto(CImg<T>& img, iRect chunk) const {
+        auto start = std::chrono::system_clock::now();
 
-        // Apply Processing functions
-        if (_Functions.size() > 0) {
-            CImg<double> imgd;
-            imgd.assign(img);
-            //if (Options::Verbose() > 3 && (chunk.p0()==iPoint(0,0)))
-                //    std::cout << Basename() << ": Applying function " << std::endl;
-                    //std::cout << Basename() << ": Applying function " << iFunc->F() << std::endl;
-            for (std::vector<func>::const_iterator iFunc=_Functions.begin();iFunc!=_Functions.end();iFunc++) {
-                (*iFunc)(imgd);
-            }
-            updatenodata = true;
-            img.assign(imgd);
-        }
+        ReadRawInto(img, chunk);
+        ApplyProcessing(img, chunk);
 
-        // If processing was applied update NoData values where needed
-        if (NoData() && updatenodata) {
-            cimg_forXY(img,x,y) {
-                if (imgorig(x,y) == NoDataValue()) img(x,y) = NoDataValue();
-            }
-        }
         auto elapsed = std::chrono::duration_cast<std::chrono::duration<float> >(std::chrono::system_clock::now()-start);
         if (Options::Verbose() > 3)
             std::cout << Basename() << ": read " << chunk << " in " << elapsed.count() << " seconds" << std::endl;
@@ -590,6 +764,31 @@ namespace gip {
         return img;
     }
 
+    //! Convert raw data to processed values
+    template<class T> void GeoRaster::ApplyProcessing(CImg<T>& img, iRect chunk) const {
+        // Raster operands are read (and processed) for the same chunk
+        std::vector< CImg<double> > operands(_Operands.size());
+        std::vector<const double*> data;
+        PooledBuffer<unsigned char> invalid;
+        bool anyinvalid(false);
+        for (unsigned int i=0; i<_Operands.size(); i++) {
+            BufferPool<double>::Acquire(operands[i]);
+            _Operands[i].ReadInto(operands[i], chunk);
+            data.push_back(operands[i].data());
+            if (_Operands[i].NoData()) {
+                if (!anyinvalid) invalid->assign(img.width(), img.height(), 1, 1, 0);
+                anyinvalid = true;
+                double nodata(_Operands[i].NoDataValue());
+                cimg_foroff(operands[i],j) if (operands[i][j] == nodata) (*invalid)[j] = 1;
+            }
+        }
+
+        ApplyPixelOps(img, _Functions, data, anyinvalid ? invalid->data() : NULL,
+            Gain(), Offset(), NoData(), NoDataValue());
+
+        for (unsigned int i=0; i<operands.size(); i++) BufferPool<double>::Release(operands[i]);
+    }
+
     //! Write raw CImg to file
     template<class T> GeoRaster& GeoRaster::WriteRaw(CImg<T> img, iRect chunk) {
         if (!chunk.valid()) chunk = Rect<int>(0,0,XSize(),YSize());
@@ -605,9 +804,14 @@ namespace gip {
             std::cout << Basename() << ": writing " << img.width() << " x " 
                 << img.height() << " image to rect " << chunk << std::endl;
         }
-        CPLErr err = _GDALRasterBand->RasterIO(GF_Write, chunk.x0(), chunk.y0(), 
-            chunk.width(), chunk.height(), img.data(), img.width(), img.height(), 
-            type2GDALtype(typeid(T)), 0, 0);
+        CPLErr err;
+        {
+            std::lock_guard<std::mutex> lock(IOLock());
+            err = _GDALRasterBand->RasterIO(GF_Write, chunk.x0(), chunk.y0(), 
+                chunk.width(), chunk.height(), img.data(), img.width(), img.height(), 
+                type2GDALtype(typeid(T)), 0, 0);
+        }
+        ChunkCache::Instance().Invalidate(_DatasetId, _GDALRasterBand->GetBand(), chunk);
         if (err != CE_None) {
             std::stringstream err;
             err << "error writing " << CPLGetLastErrorMsg();
@@ -635,16 +839,19 @@ namespace gip {
         band->SetColorInterpretation(_GDALRasterBand->GetColorInterpretation());
         band->SetMetadata(_GDALRasterBand->GetMetadata());
         raster.SetCoordinateSystem(*this);
-        ChunkSet chunks(XSize(), YSize());
+        ChunkSet chunks(BlockChunks());
         if (Options::Verbose() > 3)
             std::cout << Basename() << ": Processing in " << chunks.Size() << " chunks" << std::endl;
-        for (unsigned int iChunk=0; iChunk<chunks.Size(); iChunk++) {
-                CImg<T> cimg = Read<T>(chunks[iChunk]);
-                if (NoDataValue() != raster.NoDataValue()) {
-                    cimg_for(cimg,ptr,T) { if (*ptr == NoDataValue()) *ptr = raster.NoDataValue(); }
-                }
-                raster.Write(cimg,chunks[iChunk]);
-        }
+        // read and convert chunks in parallel, write them in order from this thread
+        ForEachChunk< CImg<T> >(chunks, [&](unsigned int, const iRect& chunk) {
+            CImg<T> cimg = Read<T>(chunk);
+            if (NoDataValue() != raster.NoDataValue()) {
+                cimg_for(cimg,ptr,T) { if (*ptr == NoDataValue()) *ptr = raster.NoDataValue(); }
+            }
+            return cimg;
+        }, [&](unsigned int, const iRect& chunk, CImg<T>& cimg) {
+            raster.Write(cimg,chunk);
+        });
         return *this;
     }
 
@@ -25,6 +25,8 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <thread>
 
 #include <boost/filesystem.hpp>
 #include <boost/shared_ptr.hpp>
@@ -41,11 +43,11 @@ namespace gip {
     public:
         //! \name Constructors
         //! Default constructor
-        GeoResource() : _GDALDataset() {}
+        GeoResource() : _GDALDataset(), _DatasetId(0), _IOLock(new std::mutex) {}
         //! Open existing file constructor
         GeoResource(std::string filename, bool update=false);
-        //! Create new file - TODO how specify OGRLayer
-        GeoResource(int, int, int, GDALDataType, std::string, dictionary = dictionary());
+        //! Create new file (in Options::DefaultFormat if format not given) - TODO how specify OGRLayer
+        GeoResource(int, int, int, GDALDataType, std::string, dictionary = dictionary(), std::string format = "");
 
         //! Copy constructor
         GeoResource(const GeoResource& resource);
@@ -136,6 +138,10 @@ namespace gip {
 
         //! Get chunkset chunking up image
         ChunkSet Chunks(unsigned int padding=0, unsigned int numchunks=0) const;
+        //! Get chunkset of tiles aligned to the natural block size of the resource
+        ChunkSet BlockChunks(unsigned int padding=0, unsigned int numchunks=0) const;
+        //! Natural block size (of first band), the most efficient unit to read
+        Point<int> BlockSize() const;
 
         //! \name Metadata functions
         //! Get metadata item
@@ -154,12 +160,53 @@ namespace gip {
             return _GDALDataset.get();
         }
 
+        //! Lock serializing I/O on the underlying GDALDataset (shared by all copies)
+        std::mutex& IOLock() const { return *_IOLock; }
+
     protected:
         //! Filename, or some other resource identifier
         boost::filesystem::path _Filename;
 
+        //! Storage held by a scratch dataset, released after the last copy closes the dataset
+        struct ScratchSpace {
+            ScratchSpace() : bytes(0) {}
+            ~ScratchSpace();
+            //! Take bytes from the Options::ScratchSize memory budget, false if it does not fit
+            bool Reserve(double size);
+            //! Bytes taken from the memory budget
+            double bytes;
+            //! Temporary file to remove
+            boost::filesystem::path filename;
+        };
+        //! Set for scratch datasets (declared before _GDALDataset so it outlives the dataset)
+        boost::shared_ptr<ScratchSpace> _Scratch;
+
+        //! Create a temporary dataset, in memory if it fits in Options::ScratchSize, otherwise in WorkDir
+        static GeoResource Scratch(int xsz, int ysz, int bsz, GDALDataType datatype);
+
         //! Underlying GDALDataset of this file
         boost::shared_ptr<GDALDataset> _GDALDataset;
+        //! Serial number of _GDALDataset, never reused (so cached chunks of a closed dataset can't be mistaken)
+        unsigned long _DatasetId;
+        //! Next dataset serial number
+        static unsigned long NewDatasetId();
+
+        //! GDAL datasets are not thread safe, raster I/O is done holding this lock
+        boost::shared_ptr<std::mutex> _IOLock;
+
+        //! Read-only handles on the same file, one per pool worker (by ThreadPool::WorkerId)
+        /*!
+            A handle is closed when its worker exits, so handles never outlive the pool they serve.
+        */
+        struct DatasetHandles {
+            std::mutex lock;
+            std::map<unsigned long, boost::shared_ptr<GDALDataset> > handles;
+        };
+        //! Handle pool, only set for read-only datasets that can be reopened
+        boost::shared_ptr<DatasetHandles> _Handles;
+
+        //! Dataset handle private to the calling worker thread (NULL if the shared one must be used)
+        GDALDataset* ThreadDataset() const;
 
         //! Retrieve the GDALMajorObject from (GDALDataset, GDALRasterBand, OGRLayer)
         GDALMajorObject* GetGDALObject() const {
@@ -0,0 +1,71 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#ifndef GIP_LINEARALGEBRA_H
+#define GIP_LINEARALGEBRA_H
+
+#include <cstddef>
+#include <algorithm>
+#ifdef GIP_CBLAS
+#include <cblas.h>
+#endif
+
+namespace gip {
+
+    //! C = A B, with A m x k, B k x n and C m x n, all row-major with the given row strides
+    /*!
+        Rows of B are taken in panels so a panel stays in cache while every row of A is run against it,
+        and the innermost loop runs along contiguous rows of B and C.  Built with GIP_CBLAS the float
+        and double versions call the system BLAS.
+    */
+    template<class T> void Gemm(size_t m, size_t n, size_t k, const T* a, size_t lda,
+            const T* b, size_t ldb, T* c, size_t ldc) {
+        const size_t panel(64);
+        for (size_t i=0; i<m; i++) std::fill(c + i*ldc, c + i*ldc + n, T(0));
+        for (size_t k0=0; k0<k; k0+=panel) {
+            size_t k1(std::min(k, k0 + panel));
+            for (size_t i=0; i<m; i++) {
+                T* ci(c + i*ldc);
+                const T* ai(a + i*lda);
+                for (size_t kk=k0; kk<k1; kk++) {
+                    const T aik(ai[kk]);
+                    const T* bk(b + kk*ldb);
+                    for (size_t j=0; j<n; j++) ci[j] += aik * bk[j];
+                }
+            }
+        }
+    }
+
+#ifdef GIP_CBLAS
+    template<> inline void Gemm<float>(size_t m, size_t n, size_t k, const float* a, size_t lda,
+            const float* b, size_t ldb, float* c, size_t ldc) {
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 1.0f, a, lda, b, ldb, 0.0f, c, ldc);
+    }
+
+    template<> inline void Gemm<double>(size_t m, size_t n, size_t k, const double* a, size_t lda,
+            const double* b, size_t ldb, double* c, size_t ldc) {
+        cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 1.0, a, lda, b, ldb, 0.0, c, ldc);
+    }
+#endif
+
+} // namespace gip
+
+#endif
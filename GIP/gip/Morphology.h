@@ -0,0 +1,283 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#ifndef GIP_MORPHOLOGY_H
+#define GIP_MORPHOLOGY_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include <cmath>
+#include <gip/gip_CImg.h>
+
+namespace gip {
+
+    //! Running minimum, identity is the largest value
+    template<class T> struct MinOp {
+        static T Identity() {
+            return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+        }
+        static T Apply(T a, T b) { return b < a ? b : a; }
+    };
+
+    //! Running maximum, identity is the smallest value
+    template<class T> struct MaxOp {
+        static T Identity() {
+            return std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest();
+        }
+        static T Apply(T a, T b) { return a < b ? b : a; }
+    };
+
+    //! Running AND of packed bits (erosion of binary masks)
+    struct AndOp {
+        static uint64_t Identity() { return ~uint64_t(0); }
+        static uint64_t Apply(uint64_t a, uint64_t b) { return a & b; }
+    };
+
+    //! Running OR of packed bits (dilation of binary masks)
+    struct OrOp {
+        static uint64_t Identity() { return 0; }
+        static uint64_t Apply(uint64_t a, uint64_t b) { return a | b; }
+    };
+
+    //! van Herk/Gil-Werman running extreme over windows of size s of lanes parallel lines, in place
+    /*!
+        Element k of lane j is at data[k*stride + j].  Output k combines the elements k-before to
+        k+s-1-before, elements past the ends of the line are skipped (treated as the identity).
+        Costs 3 operations per element whatever the window size, g and h are scratch.
+    */
+    template<class Op, class T> void RunningExtreme(T* data, int length, size_t stride, int lanes,
+            int s, int before, std::vector<T>& g, std::vector<T>& h) {
+        if (s <= 1 || length <= 0) return;
+        // padded position j is element j-before, whole blocks of s elements
+        int blocks((length + 2*s - 2) / s);
+        int n(blocks * s);
+        g.resize((size_t)n * lanes);
+        h.resize((size_t)n * lanes);
+        const T identity(Op::Identity());
+        // prefix within each block
+        for (int j=0; j<n; j++) {
+            int k(j - before);
+            T* gj(&g[(size_t)j*lanes]);
+            const T* gprev(gj - lanes);
+            const T* in((k >= 0 && k < length) ? data + k*stride : NULL);
+            bool first(j % s == 0);
+            for (int l=0; l<lanes; l++) {
+                T v(in ? in[l] : identity);
+                gj[l] = first ? v : Op::Apply(gprev[l], v);
+            }
+        }
+        // suffix within each block
+        for (int j=n-1; j>=0; j--) {
+            int k(j - before);
+            T* hj(&h[(size_t)j*lanes]);
+            const T* hnext(hj + lanes);
+            const T* in((k >= 0 && k < length) ? data + k*stride : NULL);
+            bool last(j % s == s-1);
+            for (int l=0; l<lanes; l++) {
+                T v(in ? in[l] : identity);
+                hj[l] = last ? v : Op::Apply(hnext[l], v);
+            }
+        }
+        // window [k, k+s-1] in padded positions is a suffix of one block and a prefix of the next
+        for (int k=0; k<length; k++) {
+            T* out(data + k*stride);
+            const T* hk(&h[(size_t)k*lanes]);
+            const T* gk(&g[(size_t)(k+s-1)*lanes]);
+            for (int l=0; l<lanes; l++) out[l] = Op::Apply(hk[l], gk[l]);
+        }
+    }
+
+    //! Separable running extreme over a sx by sy rectangle, windows start before(s) = s - 1 - s/2 or s/2
+    template<class Op, class T> void RectangleExtreme(CImg<T>& img, int sx, int sy, int xbefore, int ybefore) {
+        std::vector<T> g, h;
+        // rows one at a time, columns in strips so the scratch stays small
+        if (sx > 1 && img.width() > 1) {
+            cimg_forYZC(img,y,z,c) RunningExtreme<Op>(img.data(0,y,z,c), img.width(), 1, 1, sx, xbefore, g, h);
+        }
+        if (sy > 1 && img.height() > 1) {
+            const int strip(256);
+            cimg_forZC(img,z,c) {
+                for (int x0=0; x0<img.width(); x0+=strip)
+                    RunningExtreme<Op>(img.data(x0,0,z,c), img.height(), img.width(), std::min(strip, img.width()-x0), sy, ybefore, g, h);
+            }
+        }
+    }
+
+    //! Shift packed row bits so out bit x = in bit x+d, bits from outside the row are fill
+    inline void ShiftBits(const uint64_t* in, uint64_t* out, int nwords, int d, uint64_t fill) {
+        int q(d >= 0 ? d / 64 : -((-d + 63) / 64));
+        int r(d - q*64);
+        for (int w=0; w<nwords; w++) {
+            int i(w + q);
+            uint64_t lo((i >= 0 && i < nwords) ? in[i] : fill);
+            uint64_t hi((i+1 >= 0 && i+1 < nwords) ? in[i+1] : fill);
+            out[w] = r ? ((lo >> r) | (hi << (64-r))) : lo;
+        }
+    }
+
+    //! Erode or dilate a 0/1 image with one bit per pixel, 64 pixels per operation
+    /*!
+        Rows use shift-and-combine doubling (log2(sx) shifts), columns the running extreme of words.
+    */
+    template<class Op, class T> void BinaryRectangle(CImg<T>& img, int sx, int sy, int xbefore, int ybefore) {
+        int width(img.width()), height(img.height());
+        if (sx <= 1 || width <= 1) {
+            sx = 1;
+            xbefore = 0;
+        }
+        // row bit j is pixel j-xbefore, so windows [j, j+sx-1] never reach past the padded row
+        int padwidth(width + sx - 1);
+        int nwords((padwidth + 63) / 64);
+        const uint64_t fill(Op::Identity());
+        // bits past the padded width hold the identity
+        const uint64_t tail(padwidth % 64 ? ~uint64_t(0) << (padwidth % 64) : 0);
+        std::vector<uint64_t> bits((size_t)nwords * height), shifted(nwords), g, h;
+        cimg_forZC(img,z,c) {
+            for (int y=0; y<height; y++) {
+                uint64_t* row(&bits[(size_t)y*nwords]);
+                const T* in(img.data(0,y,z,c));
+                std::fill(row, row+nwords, fill);
+                for (int x=0; x<width; x++) {
+                    int j(x + xbefore);
+                    uint64_t bit(uint64_t(1) << (j & 63));
+                    row[j >> 6] = in[x] ? (row[j >> 6] | bit) : (row[j >> 6] & ~bit);
+                }
+                // row[j] combines bits j to j+span-1
+                for (int span=1; span<sx; ) {
+                    int step(std::min(span, sx-span));
+                    ShiftBits(row, &shifted[0], nwords, step, fill);
+                    for (int w=0; w<nwords; w++) row[w] = Op::Apply(row[w], shifted[w]);
+                    row[nwords-1] = (row[nwords-1] & ~tail) | (fill & tail);
+                    span += step;
+                }
+            }
+            if (sy > 1 && height > 1)
+                RunningExtreme<Op>(&bits[0], height, nwords, nwords, sy, ybefore, g, h);
+            for (int y=0; y<height; y++) {
+                const uint64_t* row(&bits[(size_t)y*nwords]);
+                T* out(img.data(0,y,z,c));
+                for (int x=0; x<width; x++) out[x] = (row[x >> 6] >> (x & 63)) & 1;
+            }
+        }
+    }
+
+    //! Determine if all pixels are 0 or 1
+    template<class T> bool IsBinary(const CImg<T>& img) {
+        cimg_for(img,ptr,T) if (*ptr != 0 && *ptr != 1) return false;
+        return true;
+    }
+
+    //! Erode by a sx by sy rectangle, at the same cost for any size
+    /*!
+        Matches CImg erode(sx,sy) when the rectangle is smaller than the image.  For larger
+        rectangles (e.g., on small edge chunks) CImg 1.5.2 reads outside the image, whereas
+        this takes the extreme over the part of the rectangle inside it.
+    */
+    template<class T> CImg<T>& Erode(CImg<T>& img, unsigned int sx, unsigned int sy) {
+        if (img.is_empty() || (sx <= 1 && sy <= 1)) return img;
+        if (IsBinary(img))
+            BinaryRectangle<AndOp>(img, sx, sy, sx/2, sy/2);
+        else RectangleExtreme< MinOp<T> >(img, sx, sy, sx/2, sy/2);
+        return img;
+    }
+
+    //! Dilate by a sx by sy rectangle, at the same cost for any size
+    /*!
+        Matches CImg dilate(sx,sy) when the rectangle is smaller than the image; see Erode.
+    */
+    template<class T> CImg<T>& Dilate(CImg<T>& img, unsigned int sx, unsigned int sy) {
+        if (img.is_empty() || (sx <= 1 && sy <= 1)) return img;
+        int xbefore(sx > 1 ? sx - 1 - sx/2 : 0), ybefore(sy > 1 ? sy - 1 - sy/2 : 0);
+        if (IsBinary(img))
+            BinaryRectangle<OrOp>(img, sx, sy, xbefore, ybefore);
+        else RectangleExtreme< MaxOp<T> >(img, sx, sy, xbefore, ybefore);
+        return img;
+    }
+
+    //! Project a mask along a direction, setting pixels p where a nonzero pixel lies at p + t*(dx,dy), tmin <= t <= 1
+    /*!
+        Pixels are swept along digital lines of the direction (the larger of |dx| and |dy| is the
+        number of steps), one pass recording for each pixel the nearest nonzero pixel ahead on its
+        line and one pass testing whether that lies within the range of t.  The cost is independent
+        of the length, and a range of cloud heights is projected at once with tmin > 0.
+    */
+    template<class T> CImg<T>& ProjectMask(CImg<T>& img, float dx, float dy, float tmin=0) {
+        int kmax(std::round(std::max(std::fabs(dx), std::fabs(dy))));
+        if (img.is_empty() || kmax == 0) return img;
+        int kmin(std::min(std::max((int)std::round(tmin * kmax), 0), kmax));
+        // lines advance one pixel per step along the major axis u, f(u) along the minor axis v
+        bool xmajor(std::fabs(dx) >= std::fabs(dy));
+        int nmaj(xmajor ? img.width() : img.height());
+        int nmin(xmajor ? img.height() : img.width());
+        size_t smaj(xmajor ? 1 : img.width()), smin(xmajor ? img.width() : 1);
+        int dir((xmajor ? dx : dy) > 0 ? 1 : -1);
+        double slope(xmajor ? dy/dx : dx/dy);
+        std::vector<int> f(nmaj);
+        for (int u=0; u<nmaj; u++) f[u] = std::round(u * slope);
+        int fmin(std::min(f[0], f[nmaj-1])), fmax(std::max(f[0], f[nmaj-1]));
+        // line of pixel (u,v) is v - f(u), nearest nonzero pixel ahead on each line (major position)
+        const int none(INT_MAX);
+        std::vector<int> ahead(nmin + fmax - fmin);
+        CImg<int> closest(img.width(), img.height(), 1, 1);
+
+        // rows holding the pixels further along the direction are swept first
+        bool rowsdown(slope * dir < 0);
+        cimg_forZC(img,z,c) {
+            T* data(img.data(0,0,z,c));
+            std::fill(ahead.begin(), ahead.end(), none);
+            for (int i=0; i<nmin; i++) {
+                int v(rowsdown ? i : nmin-1-i);
+                for (int j=0; j<nmaj; j++) {
+                    int u(dir > 0 ? nmaj-1-j : j);
+                    size_t pix(u*smaj + v*smin);
+                    int& a(ahead[v - f[u] + fmax]);
+                    if (data[pix]) a = u;
+                    closest[pix] = a;
+                }
+            }
+            for (int v=0; v<nmin; v++) {
+                for (int u=0; u<nmaj; u++) {
+                    size_t pix(u*smaj + v*smin);
+                    if (data[pix]) continue;
+                    // nearest nonzero pixel at or beyond kmin steps, the line leaves the image for good
+                    int u2(u + dir*kmin);
+                    if (u2 < 0 || u2 >= nmaj) continue;
+                    int v2(v + f[u2] - f[u]);
+                    if (v2 < 0 || v2 >= nmin) continue;
+                    int n(closest[u2*smaj + v2*smin]);
+                    if (n != none && std::abs(n - u) <= kmax) data[pix] = 1;
+                }
+            }
+        }
+        return img;
+    }
+
+    //! Halo (pixels) a chunk needs so Erode(erode) followed by Dilate(dilate) is exact in its interior
+    inline int MorphologyPadding(int erode, int dilate) {
+        return (erode > 1 ? erode/2 : 0) + (dilate > 1 ? dilate/2 : 0);
+    }
+
+} // namespace gip
+
+#endif
@@ -0,0 +1,250 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#ifndef GIP_PIXELOPS_H
+#define GIP_PIXELOPS_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <boost/function.hpp>
+
+#include <gip/gip_CImg.h>
+#include <gip/BufferPool.h>
+
+namespace gip {
+
+    //! One step of a GeoRaster operator chain, applied to pixel values on read
+    /*!
+        Built-in operators are stored as an opcode and operand so a whole chain can be evaluated
+        in a single pass.  The operand is either a value or another raster read for the same chunk.  Generic functions (added with AddFunction) operate on an entire chunk
+        and are applied in their own pass.
+    */
+    class PixelOp {
+    public:
+        typedef boost::function< CImg<double>& (CImg<double>&) > func;
+
+        enum Code {
+            Add, Subtract, Multiply, Divide, Max, Min, Pow,
+            Sqrt, Log, Log10, Exp, Abs, Sign,
+            Cos, Sin, Tan, Acos, Asin, Atan, Cosh, Sinh, Tanh, Sinc,
+            Greater, GreaterEqual, Less, LessEqual, Equal, BXOR,
+            Function
+        };
+
+        //! Built-in operator with an (optional) operand
+        PixelOp(Code code, double value=0) : _Code(code), _Value(value), _Operand(-1) {}
+        //! Generic function of a whole chunk
+        PixelOp(func f) : _Code(Function), _Value(0), _Operand(-1), _Func(f) {}
+        //! Built-in binary operator whose right operand is raster number operand of the chain
+        static PixelOp Binary(Code code, unsigned int operand) {
+            PixelOp op(code);
+            op._Operand = operand;
+            return op;
+        }
+
+        //! Operator code
+        Code code() const { return _Code; }
+        //! Operand
+        double value() const { return _Value; }
+        //! Index of the raster operand, or -1 if the operand is a value
+        int Operand() const { return _Operand; }
+        //! True if this can be evaluated pixel by pixel within a fused chain
+        bool Fused() const { return _Code != Function; }
+
+        //! Apply a built-in operator to n consecutive values
+        /*!
+            operand holds the n matching values of the raster operand (if any).
+            Results match the CImg operations previously used for each operator.
+        */
+        void Apply(double* v, size_t n, const double* operand=NULL) const {
+            if (_Operand >= 0) {
+                Run(v, n, Values(operand));
+                return;
+            }
+            const double a(_Value);
+            size_t i;
+            if (_Code == Pow) {
+                if (a == 0) for (i=0; i<n; i++) v[i] = 1;
+                else if (a == 0.5) for (i=0; i<n; i++) v[i] = std::sqrt(v[i]);
+                else if (a == 1) return;
+                else if (a == 2) for (i=0; i<n; i++) v[i] = v[i]*v[i];
+                else if (a == 3) for (i=0; i<n; i++) v[i] = v[i]*v[i]*v[i];
+                else if (a == 4) for (i=0; i<n; i++) v[i] = v[i]*v[i]*v[i]*v[i];
+                else for (i=0; i<n; i++) v[i] = std::pow(v[i], a);
+                return;
+            }
+            Run(v, n, Value(a));
+        }
+
+        //! Apply a generic function to a whole chunk
+        CImg<double>& operator()(CImg<double>& img, const double* operand=NULL) const {
+            if (_Code == Function) return _Func(img);
+            Apply(img.data(), img.size(), operand);
+            return img;
+        }
+
+    private:
+        //! Scalar operand
+        struct Value {
+            Value(double a) : a(a) {}
+            double operator[](size_t) const { return a; }
+            double a;
+        };
+        //! Per-pixel operand
+        struct Values {
+            Values(const double* a) : a(a) {}
+            double operator[](size_t i) const { return a[i]; }
+            const double* a;
+        };
+
+        //! Evaluate the operator over n values
+        /*!
+            The switch is outside of the loop so each case is a simple loop the compiler can vectorize.
+        */
+        template<class A> void Run(double* v, size_t n, const A& a) const {
+            size_t i;
+            switch (_Code) {
+                case Add: for (i=0; i<n; i++) v[i] += a[i]; break;
+                case Subtract: for (i=0; i<n; i++) v[i] -= a[i]; break;
+                case Multiply: for (i=0; i<n; i++) v[i] *= a[i]; break;
+                case Divide: for (i=0; i<n; i++) v[i] /= a[i]; break;
+                case Max: for (i=0; i<n; i++) v[i] = v[i] >= a[i] ? v[i] : a[i]; break;
+                case Min: for (i=0; i<n; i++) v[i] = v[i] <= a[i] ? v[i] : a[i]; break;
+                case Pow: for (i=0; i<n; i++) v[i] = std::pow(v[i], a[i]); break;
+                case Sqrt: for (i=0; i<n; i++) v[i] = std::sqrt(v[i]); break;
+                case Log: for (i=0; i<n; i++) v[i] = std::log(v[i]); break;
+                case Log10: for (i=0; i<n; i++) v[i] = std::log10(v[i]); break;
+                case Exp: for (i=0; i<n; i++) v[i] = std::exp(v[i]); break;
+                case Abs: for (i=0; i<n; i++) v[i] = std::fabs(v[i]); break;
+                case Sign: for (i=0; i<n; i++) v[i] = v[i] < 0 ? -1 : (v[i] == 0 ? 0 : 1); break;
+                case Cos: for (i=0; i<n; i++) v[i] = std::cos(v[i]); break;
+                case Sin: for (i=0; i<n; i++) v[i] = std::sin(v[i]); break;
+                case Tan: for (i=0; i<n; i++) v[i] = std::tan(v[i]); break;
+                case Acos: for (i=0; i<n; i++) v[i] = std::acos(v[i]); break;
+                case Asin: for (i=0; i<n; i++) v[i] = std::asin(v[i]); break;
+                case Atan: for (i=0; i<n; i++) v[i] = std::atan(v[i]); break;
+                case Cosh: for (i=0; i<n; i++) v[i] = std::cosh(v[i]); break;
+                case Sinh: for (i=0; i<n; i++) v[i] = std::sinh(v[i]); break;
+                case Tanh: for (i=0; i<n; i++) v[i] = std::tanh(v[i]); break;
+                case Sinc: for (i=0; i<n; i++) v[i] = v[i] ? std::sin(v[i])/v[i] : 1; break;
+                case Greater: for (i=0; i<n; i++) v[i] = v[i] > a[i] ? 1 : 0; break;
+                case GreaterEqual: for (i=0; i<n; i++) v[i] = v[i] >= a[i] ? 1 : 0; break;
+                // written as negations so NaN compares the same as threshold followed by XOR 1
+                case Less: for (i=0; i<n; i++) v[i] = v[i] >= a[i] ? 0 : 1; break;
+                case LessEqual: for (i=0; i<n; i++) v[i] = v[i] > a[i] ? 0 : 1; break;
+                case Equal: for (i=0; i<n; i++) v[i] = v[i] == a[i] ? 1 : 0; break;
+                case BXOR:
+                    for (i=0; i<n; i++) v[i] = (double)((unsigned long)v[i] ^ (unsigned long)a[i]);
+                    break;
+                case Function: break;
+            }
+        }
+
+        Code _Code;
+        double _Value;
+        int _Operand;
+        func _Func;
+    };
+
+    //! Number of pixels evaluated at a time by ApplyPixelOps, small enough to stay in L1 cache
+    static const size_t PixelOpsBlockSize = 1024;
+
+    //! Apply gain/offset and a chain of operations to raw data in place, leaving NoData pixels alone
+    /*!
+        operands are the processed chunks of the rasters used as operands by the chain, and
+        invalid (if not NULL) flags pixels where any of them is NoData; those pixels are set to NoData.
+
+        When every operation is a built-in the whole chain is fused: pixels are loaded a block at a
+        time into a small double buffer, every operation is applied to the block while it is in
+        cache, and results are stored back skipping NoData, so the chunk is swept through memory once.
+        Chains containing generic functions fall back to a double copy of the chunk with one pass
+        per function.
+    */
+    template<class T> void ApplyPixelOps(CImg<T>& img, const std::vector<PixelOp>& ops,
+            const std::vector<const double*>& operands, const unsigned char* invalid,
+            double gain, double offset, bool usenodata, double nodata) {
+        bool scale(gain != 1.0 || offset != 0.0);
+        bool fused(true);
+        for (unsigned int i=0; i<ops.size(); i++) if (!ops[i].Fused()) fused = false;
+
+        if (fused) {
+            if (!scale && ops.empty() && invalid == NULL) return;
+            double block[PixelOpsBlockSize];
+            T* data(img.data());
+            size_t size(img.size());
+            for (size_t start=0; start<size; start+=PixelOpsBlockSize) {
+                T* ptr(data + start);
+                size_t n(std::min(PixelOpsBlockSize, size-start));
+                // scaled values are stored as T before further processing
+                if (scale)
+                    for (size_t i=0; i<n; i++) block[i] = (T)(gain * ptr[i] + offset);
+                else
+                    for (size_t i=0; i<n; i++) block[i] = ptr[i];
+                for (unsigned int iop=0; iop<ops.size(); iop++) {
+                    int operand(ops[iop].Operand());
+                    ops[iop].Apply(block, n, operand < 0 ? NULL : operands[operand] + start);
+                }
+                if (invalid != NULL)
+                    for (size_t i=0; i<n; i++) if (invalid[start+i]) block[i] = nodata;
+                if (usenodata) {
+                    for (size_t i=0; i<n; i++) if (ptr[i] != nodata) ptr[i] = (T)block[i];
+                } else {
+                    for (size_t i=0; i<n; i++) ptr[i] = (T)block[i];
+                }
+            }
+            return;
+        }
+
+        // Remember where NoData is, generic functions may change those pixels
+        PooledBuffer<unsigned char> nodatamask;
+        if (usenodata || invalid != NULL) {
+            nodatamask->assign(img.width(), img.height(), img.depth(), img.spectrum());
+            unsigned char* m(nodatamask->data());
+            if (usenodata) {
+                cimg_for(img,ptr,T) *(m++) = (*ptr == nodata);
+            } else nodatamask->fill(0);
+            if (invalid != NULL)
+                cimg_foroff(*nodatamask,i) (*nodatamask)[i] |= invalid[i];
+        }
+        if (scale) {
+            if (usenodata) {
+                cimg_for(img,ptr,T) if (*ptr != nodata) *ptr = gain * *ptr + offset;
+            } else {
+                cimg_for(img,ptr,T) *ptr = gain * *ptr + offset;
+            }
+        }
+        PooledBuffer<double> imgd;
+        imgd->assign(img);
+        for (unsigned int iop=0; iop<ops.size(); iop++) {
+            int operand(ops[iop].Operand());
+            ops[iop](*imgd, operand < 0 ? NULL : operands[operand]);
+        }
+        img.assign(*imgd);
+        if (usenodata || invalid != NULL) {
+            const unsigned char* m(nodatamask->data());
+            cimg_for(img,ptr,T) if (*(m++)) *ptr = nodata;
+        }
+    }
+
+} // namespace gip
+
+#endif
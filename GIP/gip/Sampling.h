@@ -0,0 +1,96 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+
+#ifndef GIP_SAMPLING_H
+#define GIP_SAMPLING_H
+
+#include <stdint.h>
+#include <random>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+namespace gip {
+
+    //! Seed for a sampler's generator, taken from the system when seed is 0
+    inline uint64_t SamplerSeed(uint64_t seed) {
+        if (seed != 0) return seed;
+        std::random_device device;
+        return (uint64_t(device()) << 32) | device();
+    }
+
+    //! Uniform random sample of up to K items from a stream
+    /*!
+        Every item offered gets a random key and the K smallest keys are kept (in a max-heap).
+        Unlike classic reservoir sampling this doesn't depend on the order items arrive in, so
+        samples of separate parts of a stream can be taken in parallel and merged exactly.
+    */
+    template<class T> class Reservoir {
+    public:
+        Reservoir(size_t k=0) : _K(k) {}
+
+        //! Determine if an item with this key would be kept (so it need not be built otherwise)
+        bool Accepts(uint64_t key) const {
+            if (_K == 0) return false;
+            return _Items.size() < _K || key < _Items.front().first;
+        }
+
+        //! Offer an item with its random key
+        void Add(uint64_t key, const T& item) {
+            if (!Accepts(key)) return;
+            if (_Items.size() == _K) {
+                std::pop_heap(_Items.begin(), _Items.end(), Compare);
+                _Items.pop_back();
+            }
+            _Items.push_back(std::make_pair(key, item));
+            std::push_heap(_Items.begin(), _Items.end(), Compare);
+        }
+
+        //! Merge in a sample of another part of the stream
+        void Merge(const Reservoir& other) {
+            for (size_t i=0; i<other._Items.size(); i++) Add(other._Items[i].first, other._Items[i].second);
+        }
+
+        //! Number of items in the sample
+        size_t size() const { return _Items.size(); }
+
+        //! Sampled items, in order of key
+        std::vector<T> Items() const {
+            std::vector< std::pair<uint64_t, T> > items(_Items);
+            std::sort(items.begin(), items.end(), Compare);
+            std::vector<T> result;
+            for (size_t i=0; i<items.size(); i++) result.push_back(items[i].second);
+            return result;
+        }
+
+    private:
+        static bool Compare(const std::pair<uint64_t, T>& a, const std::pair<uint64_t, T>& b) {
+            return a.first < b.first;
+        }
+
+        size_t _K;
+        std::vector< std::pair<uint64_t, T> > _Items;
+    };
+
+} // namespace gip
+
+#endif
@@ -0,0 +1,386 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#ifndef GIP_STATISTICS_H
+#define GIP_STATISTICS_H
+
+#include <cmath>
+#include <limits>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#ifdef GIP_CBLAS
+#include <cblas.h>
+#endif
+
+namespace gip {
+
+    //! Streaming count, min, max, mean and central moments of a set of values
+    /*!
+        Partial results (e.g., of different chunks or threads) merge exactly with the pairwise
+        update of Pebay (2008), so statistics of a whole raster come from a single read.
+        Within a block of values in memory the moments are computed with two passes over the
+        block, which is both faster and more accurate than a per-value update.
+    */
+    class Moments {
+    public:
+        Moments()
+            : _Count(0), _Mean(0), _M2(0), _M3(0),
+              _Min(std::numeric_limits<double>::infinity()), _Max(-std::numeric_limits<double>::infinity()) {}
+
+        //! Add a single value
+        void Add(double val) {
+            Moments one;
+            one._Count = 1;
+            one._Mean = val;
+            one._Min = val;
+            one._Max = val;
+            Merge(one);
+        }
+
+        //! Add n values, skipping those equal to nodata if skip is true
+        template<class T> void Add(const T* data, size_t n, bool skip, double nodata) {
+            AddIf(data, n, [&](size_t i) { return !(skip && data[i] == nodata); });
+        }
+
+        //! Add the n values where valid is nonzero
+        template<class T> void Add(const T* data, size_t n, const unsigned char* valid) {
+            AddIf(data, n, [&](size_t i) { return valid[i] != 0; });
+        }
+
+        //! Combine with the moments of another set of values
+        void Merge(const Moments& other) {
+            if (other._Count == 0) return;
+            if (_Count == 0) {
+                *this = other;
+                return;
+            }
+            double na(_Count), nb(other._Count), n(na + nb);
+            double delta(other._Mean - _Mean);
+            double delta_n(delta / n);
+            _M3 += other._M3 + delta*delta_n*delta_n*na*nb*(na - nb)
+                + 3.0*delta_n*(na*other._M2 - nb*_M2);
+            _M2 += other._M2 + delta*delta_n*na*nb;
+            _Mean += delta_n*nb;
+            _Count += other._Count;
+            if (other._Min < _Min) _Min = other._Min;
+            if (other._Max > _Max) _Max = other._Max;
+        }
+
+        //! Number of values
+        double Count() const { return _Count; }
+        //! Minimum value
+        double Min() const { return _Min; }
+        //! Maximum value
+        double Max() const { return _Max; }
+        //! Mean value
+        double Mean() const { return _Count > 0 ? _Mean : std::numeric_limits<double>::quiet_NaN(); }
+        //! Population variance
+        double Variance() const { return _M2 / _Count; }
+        //! Population standard deviation
+        double StdDev() const { return std::sqrt(Variance()); }
+        //! Skewness
+        double Skewness() const {
+            double var(Variance());
+            return (_M3 / _Count) / std::sqrt(var*var*var);
+        }
+
+    private:
+        //! Add the values for which use(i) is true, two passes over the block
+        template<class T, class U> void AddIf(const T* data, size_t n, U use) {
+            Moments block;
+            double total(0);
+            for (size_t i=0; i<n; i++) {
+                if (!use(i)) continue;
+                double val(data[i]);
+                block._Count++;
+                total += val;
+                if (val < block._Min) block._Min = val;
+                if (val > block._Max) block._Max = val;
+            }
+            if (block._Count == 0) return;
+            block._Mean = total / block._Count;
+            double dev;
+            for (size_t i=0; i<n; i++) {
+                if (!use(i)) continue;
+                dev = data[i] - block._Mean;
+                block._M2 += dev*dev;
+                block._M3 += dev*dev*dev;
+            }
+            Merge(block);
+        }
+
+        double _Count;
+        double _Mean;
+        //! Sums of squared and cubed deviations from the mean
+        double _M2;
+        double _M3;
+        double _Min;
+        double _Max;
+    };
+
+    //! Moments of several bands over the same pixels, optionally with their co-moments
+    /*!
+        Each band keeps its own Moments, and the sums of cross products of deviations from the means
+        (co-moments) give the covariance.  Partials merge exactly (Chan et al.), like Moments.
+    */
+    class JointMoments {
+    public:
+        JointMoments(unsigned int numbands=0, bool covariance=false)
+            : _Bands(numbands), _Covariance(covariance),
+              _CoMoments(covariance ? numbands*numbands : 0, 0.0) {}
+
+        //! Number of bands
+        unsigned int NumBands() const { return _Bands.size(); }
+        //! Moments of band b
+        const Moments& operator[](unsigned int b) const { return _Bands[b]; }
+        //! Number of pixels
+        double Count() const { return _Bands.empty() ? 0 : _Bands[0].Count(); }
+
+        //! Add n pixels where valid is nonzero, band b starting at data + b*stride
+        template<class T> void Add(const T* data, size_t n, size_t stride, const unsigned char* valid) {
+            unsigned int nb(NumBands());
+            JointMoments block(nb, _Covariance);
+            for (unsigned int b=0; b<nb; b++) block._Bands[b].Add(data + b*stride, n, valid);
+            if (block.Count() == 0) return;
+            if (_Covariance) {
+                std::vector<double> means(nb);
+                for (unsigned int b=0; b<nb; b++) means[b] = block._Bands[b].Mean();
+                // deviations of valid pixels gathered into panels, band rows of PanelSize pixels
+                std::vector<double> panel(nb * PanelSize);
+                size_t m(0);
+                for (size_t i=0; i<n; i++) {
+                    if (!valid[i]) continue;
+                    for (unsigned int b=0; b<nb; b++) panel[b*PanelSize + m] = data[b*stride + i] - means[b];
+                    if (++m == PanelSize) {
+                        Syrk(&panel[0], nb, m, &block._CoMoments[0]);
+                        m = 0;
+                    }
+                }
+                if (m > 0) Syrk(&panel[0], nb, m, &block._CoMoments[0]);
+                std::vector<double>& c(block._CoMoments);
+                for (unsigned int b0=0; b0<nb; b0++)
+                    for (unsigned int b1=0; b1<b0; b1++) c[b0*nb + b1] = c[b1*nb + b0];
+            }
+            Merge(block);
+        }
+
+        //! Combine with the moments of another set of pixels
+        void Merge(const JointMoments& other) {
+            if (other.Count() == 0) return;
+            if (Count() == 0) {
+                *this = other;
+                return;
+            }
+            unsigned int nb(NumBands());
+            if (_Covariance) {
+                double na(Count()), nb_(other.Count()), n(na + nb_);
+                for (unsigned int b0=0; b0<nb; b0++) {
+                    double d0(other._Bands[b0].Mean() - _Bands[b0].Mean());
+                    for (unsigned int b1=0; b1<nb; b1++) {
+                        double d1(other._Bands[b1].Mean() - _Bands[b1].Mean());
+                        _CoMoments[b0*nb + b1] += other._CoMoments[b0*nb + b1] + d0*d1*na*nb_/n;
+                    }
+                }
+            }
+            for (unsigned int b=0; b<nb; b++) _Bands[b].Merge(other._Bands[b]);
+        }
+
+        //! Sample (unbiased) covariance of bands b0 and b1
+        double Covariance(unsigned int b0, unsigned int b1) const {
+            return _CoMoments[b0*NumBands() + b1] / (Count() - 1);
+        }
+        //! True if co-moments are accumulated
+        bool HasCovariance() const { return _Covariance; }
+
+    private:
+        //! Pixels per panel of deviations, a panel of a few bands stays in cache
+        static const size_t PanelSize = 256;
+
+        //! Add the upper triangle of A A' to c (nb x nb), A is nb rows of m values PanelSize apart
+        static void Syrk(const double* a, unsigned int nb, size_t m, double* c) {
+#ifdef GIP_CBLAS
+            cblas_dsyrk(CblasRowMajor, CblasUpper, CblasNoTrans, nb, m, 1.0, a, PanelSize, 1.0, c, nb);
+#else
+            // each row of A against four others at once, so every value loaded feeds four sums
+            for (unsigned int b0=0; b0<nb; b0++) {
+                const double* r0(a + b0*PanelSize);
+                unsigned int b1(b0);
+                for (; b1+4<=nb; b1+=4) {
+                    const double *r1(a + b1*PanelSize), *r2(r1 + PanelSize), *r3(r2 + PanelSize), *r4(r3 + PanelSize);
+                    double s1(0), s2(0), s3(0), s4(0);
+                    for (size_t k=0; k<m; k++) {
+                        double v(r0[k]);
+                        s1 += v*r1[k];
+                        s2 += v*r2[k];
+                        s3 += v*r3[k];
+                        s4 += v*r4[k];
+                    }
+                    c[b0*nb + b1] += s1;
+                    c[b0*nb + b1+1] += s2;
+                    c[b0*nb + b1+2] += s3;
+                    c[b0*nb + b1+3] += s4;
+                }
+                for (; b1<nb; b1++) {
+                    const double* r1(a + b1*PanelSize);
+                    double s1(0);
+                    for (size_t k=0; k<m; k++) s1 += r0[k]*r1[k];
+                    c[b0*nb + b1] += s1;
+                }
+            }
+#endif
+        }
+
+        std::vector<Moments> _Bands;
+        bool _Covariance;
+        //! Sums of products of deviations, NumBands x NumBands
+        std::vector<double> _CoMoments;
+    };
+
+    //! Mergeable streaming quantile sketch (t-digest)
+    /*!
+        Values are summarized by weighted centroids, small near the extremes and larger near the
+        median (the arcsine scale function of Dunning and Ertl), so tail quantiles are the most
+        accurate.  Rank error shrinks as the compression (roughly the number of centroids) grows.
+        Digests of different chunks merge into a digest of all of their values.
+    */
+    class TDigest {
+    public:
+        TDigest(double compression=200)
+            : _Compression(std::max(compression, 20.0)), _Count(0),
+              _Min(std::numeric_limits<double>::infinity()), _Max(-std::numeric_limits<double>::infinity()) {}
+
+        //! Add a value with a weight (NaN and infinite values are ignored, they can't be ordered)
+        void Add(double val, double weight=1) {
+            if (!std::isfinite(val)) return;
+            _Buffer.push_back(centroid(val, weight));
+            _Count += weight;
+            if (val < _Min) _Min = val;
+            if (val > _Max) _Max = val;
+            if (_Buffer.size() >= BufferSize()) Compress();
+        }
+
+        //! Add n values, skipping those equal to nodata if skip is true
+        template<class T> void Add(const T* data, size_t n, bool skip, double nodata) {
+            for (size_t i=0; i<n; i++) {
+                if (skip && data[i] == nodata) continue;
+                Add(data[i]);
+            }
+        }
+
+        //! Combine with the digest of another set of values
+        void Merge(const TDigest& other) {
+            if (other._Count == 0) return;
+            _Buffer.insert(_Buffer.end(), other._Centroids.begin(), other._Centroids.end());
+            _Buffer.insert(_Buffer.end(), other._Buffer.begin(), other._Buffer.end());
+            _Count += other._Count;
+            _Min = std::min(_Min, other._Min);
+            _Max = std::max(_Max, other._Max);
+            Compress();
+        }
+
+        //! Total weight of values
+        double Count() const { return _Count; }
+
+        //! Estimate of the value at quantile q (0-1), interpolating between centroids
+        double Quantile(double q) {
+            Compress();
+            if (_Centroids.empty()) return std::numeric_limits<double>::quiet_NaN();
+            if (q <= 0) return _Min;
+            if (q >= 1) return _Max;
+            if (_Centroids.size() == 1) return _Centroids[0].mean;
+            // centroids are centered on their cumulative weight, min and max sit at the ends
+            double index(q * _Count);
+            const centroid& first(_Centroids.front());
+            if (index < first.weight/2)
+                return _Min + (first.mean - _Min) * index / (first.weight/2);
+            double cum(first.weight/2);
+            for (size_t i=0; i+1<_Centroids.size(); i++) {
+                double dw((_Centroids[i].weight + _Centroids[i+1].weight)/2);
+                if (cum + dw > index)
+                    return _Centroids[i].mean + (_Centroids[i+1].mean - _Centroids[i].mean) * (index - cum) / dw;
+                cum += dw;
+            }
+            const centroid& last(_Centroids.back());
+            return last.mean + (_Max - last.mean) * std::min(1.0, (index - cum) / (last.weight/2));
+        }
+
+    private:
+        struct centroid {
+            centroid(double mean=0, double weight=0) : mean(mean), weight(weight) {}
+            bool operator<(const centroid& c) const { return mean < c.mean; }
+            double mean;
+            double weight;
+        };
+
+        static double Pi() { return 3.14159265358979323846; }
+
+        //! Values buffered before merging into the centroids
+        size_t BufferSize() const { return 5 * (size_t)_Compression; }
+
+        //! Scale function: q to k
+        double K(double q) const { return _Compression / (2*Pi()) * std::asin(2*q - 1); }
+        //! Inverse of the scale function
+        double Q(double k) const {
+            double x(k * 2*Pi() / _Compression);
+            if (x >= Pi()/2) return 1;
+            return (std::sin(x) + 1) / 2;
+        }
+
+        //! Merge the buffer into the centroids
+        void Compress() {
+            if (_Buffer.empty()) return;
+            _Buffer.insert(_Buffer.end(), _Centroids.begin(), _Centroids.end());
+            std::sort(_Buffer.begin(), _Buffer.end());
+            _Centroids.clear();
+            centroid current(_Buffer[0]);
+            double sofar(0);
+            double limit(Q(K(0) + 1) * _Count);
+            for (size_t i=1; i<_Buffer.size(); i++) {
+                const centroid& c(_Buffer[i]);
+                if (sofar + current.weight + c.weight <= limit) {
+                    // weighted mean, merging into the current centroid
+                    current.weight += c.weight;
+                    current.mean += (c.mean - current.mean) * c.weight / current.weight;
+                } else {
+                    sofar += current.weight;
+                    _Centroids.push_back(current);
+                    limit = Q(K(sofar / _Count) + 1) * _Count;
+                    current = c;
+                }
+            }
+            _Centroids.push_back(current);
+            _Buffer.clear();
+        }
+
+        double _Compression;
+        double _Count;
+        double _Min;
+        double _Max;
+        //! Sorted centroids
+        std::vector<centroid> _Centroids;
+        //! Values added since the last compression
+        std::vector<centroid> _Buffer;
+    };
+
+} // namespace gip
+
+#endif
@@ -0,0 +1,61 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#ifndef GIP_STATSCACHE_H
+#define GIP_STATSCACHE_H
+
+#include <string>
+#include <mutex>
+#include <boost/filesystem.hpp>
+#include <gip/gip_CImg.h>
+
+namespace gip {
+
+    //! Statistics kept on disk next to a file, so they survive reopening it
+    /*!
+        Values are stored in filename.gipstats under a hash of a key that must identify everything
+        they depend on (file size and modification time, band, gain/offset, masks, functions and
+        the query itself).  A changed file or processing chain gives a new key, so stale entries
+        are never returned; the oldest entries are dropped once there are too many.
+    */
+    class StatsCache {
+    public:
+        //! Get values stored for key, returning false if there are none
+        static bool Get(const boost::filesystem::path& file, const std::string& key, CImg<float>& values);
+        //! Store values for key (errors writing the sidecar are ignored)
+        static void Put(const boost::filesystem::path& file, const std::string& key, const CImg<float>& values);
+        //! Sidecar file holding the statistics of file
+        static boost::filesystem::path Sidecar(const boost::filesystem::path& file) {
+            return boost::filesystem::path(file.string() + ".gipstats");
+        }
+        //! Stable 64 bit hash (FNV-1a) of a key, as hex
+        static std::string Hash(const std::string& key);
+
+    private:
+        //! Most entries kept per sidecar
+        static const unsigned int MaxEntries = 1000;
+        //! Serializes access to sidecars within the process
+        static std::mutex& Lock();
+    };
+
+} // namespace gip
+
+#endif
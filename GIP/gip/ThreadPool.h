@@ -0,0 +1,255 @@
+/*##############################################################################
+#    GIPPY: Geospatial Image Processing library for Python
+#
+#    AUTHOR: Matthew Hanson
+#    EMAIL:  matt.a.hanson@gmail.com
+#
+#    Copyright (C) 2015 Applied Geosolutions
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+##############################################################################*/
+
+#ifndef GIP_THREADPOOL_H
+#define GIP_THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <memory>
+
+#include <boost/shared_ptr.hpp>
+
+#include <gip/Utils.h>
+#include <gip/geometry.h>
+
+namespace gip {
+
+    //! Pool of worker threads with work stealing
+    /*!
+        Each worker has its own queue of tasks, taking from the front of its own queue and
+        stealing from the back of other queues when it runs out.  The process wide pool
+        is sized by Options::NumCores.
+    */
+    class ThreadPool {
+    public:
+        typedef std::function<void()> task;
+
+        //! Constructor starting the given number of workers
+        explicit ThreadPool(unsigned int numthreads);
+        //! Destructor, finishes queued tasks and joins all workers
+        ~ThreadPool();
+
+        //! Get the process wide pool (recreated if Options::NumCores has changed)
+        /*!
+            A replaced pool lives on until the last TaskGroup using it is done.
+        */
+        static boost::shared_ptr<ThreadPool> Instance();
+        //! Determine if the calling thread is a worker of any pool
+        static bool InWorker();
+        //! Id of the calling worker, unique over all workers of all pools ever started (0 if not a worker)
+        static unsigned long WorkerId();
+        //! Run func on the calling worker when it exits, i.e., when its pool is torn down
+        static void AtWorkerExit(task func);
+
+        //! Number of worker threads
+        unsigned int Size() const { return _Threads.size(); }
+        //! Add a task to the queue of a worker (hint is taken modulo number of workers)
+        void Submit(task t, unsigned int hint);
+
+    private:
+        // not copyable
+        ThreadPool(const ThreadPool&);
+        ThreadPool& operator=(const ThreadPool&);
+
+        //! Worker loop
+        void Work(unsigned int id);
+        //! Get next task, from own queue first, stealing from others if empty
+        bool Pop(unsigned int id, task& t);
+
+        std::vector<std::thread> _Threads;
+        std::vector< std::deque<task> > _Queues;
+        std::vector< boost::shared_ptr<std::mutex> > _QueueLocks;
+
+        //! Lock and condition for sleeping workers
+        std::mutex _Lock;
+        std::condition_variable _Wake;
+        //! Number of tasks waiting in all queues
+        unsigned long _Pending;
+        bool _Stop;
+    };
+
+    //! Group of tasks run on the process wide ThreadPool that can be waited on
+    /*!
+        When created from within a worker the tasks are run immediately on the calling
+        thread, so nested parallel loops never deadlock the pool.
+    */
+    class TaskGroup {
+    public:
+        TaskGroup() : _Pool(ThreadPool::InWorker() ? boost::shared_ptr<ThreadPool>() : ThreadPool::Instance()),
+            _Outstanding(0) {}
+        ~TaskGroup() {
+            std::unique_lock<std::mutex> lock(_Lock);
+            _Done.wait(lock, [this]() { return _Outstanding == 0; });
+        }
+
+        //! Number of threads tasks are spread over
+        unsigned int Size() const { return _Pool ? _Pool->Size() : 1; }
+
+        //! Submit a task (hint is the preferred worker)
+        void Submit(ThreadPool::task t, unsigned int hint=0) {
+            if (!_Pool) {
+                Execute(t);
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(_Lock);
+                _Outstanding++;
+            }
+            _Pool->Submit([this, t]() {
+                Execute(t);
+                std::lock_guard<std::mutex> lock(_Lock);
+                if (--_Outstanding == 0) _Done.notify_all();
+            }, hint);
+        }
+
+        //! Wait for all submitted tasks, rethrowing the first error raised by any of them
+        void Wait() {
+            {
+                std::unique_lock<std::mutex> lock(_Lock);
+                _Done.wait(lock, [this]() { return _Outstanding == 0; });
+            }
+            if (_Error) {
+                std::exception_ptr error(_Error);
+                _Error = std::exception_ptr();
+                std::rethrow_exception(error);
+            }
+        }
+
+    private:
+        // not copyable
+        TaskGroup(const TaskGroup&);
+        TaskGroup& operator=(const TaskGroup&);
+
+        void Execute(const ThreadPool::task& t) {
+            try {
+                t();
+            } catch(...) {
+                std::lock_guard<std::mutex> lock(_Lock);
+                if (!_Error) _Error = std::current_exception();
+            }
+        }
+
+        boost::shared_ptr<ThreadPool> _Pool;
+        std::mutex _Lock;
+        std::condition_variable _Done;
+        unsigned int _Outstanding;
+        std::exception_ptr _Error;
+    };
+
+    //! Run func(iChunk, chunk) on every chunk in parallel
+    /*!
+        Chunks are handed out to workers in contiguous runs, idle workers steal the rest.
+        func must only do thread safe work (GeoRaster reads and writes are).
+    */
+    template<class F> void ForEachChunk(const ChunkSet& chunks, F func) {
+        TaskGroup tasks;
+        unsigned int n(chunks.Size());
+        for (unsigned int i=0; i<n; i++) {
+            tasks.Submit([&func, &chunks, i]() { func(i, chunks[i]); }, (i * tasks.Size()) / n);
+        }
+        tasks.Wait();
+    }
+
+    //! Compute every chunk in parallel, writing results back on the calling thread
+    /*!
+        compute(iChunk, chunk) runs on the workers and returns a result of type R, write(iChunk, chunk, result)
+        is called on the calling thread, in chunk order if ordered is set, otherwise as chunks complete.
+        Only a window of 2 chunks per worker is in flight at once to bound memory use.
+    */
+    template<class R, class F, class W> void ForEachChunk(const ChunkSet& chunks, F compute, W write, bool ordered=true) {
+        unsigned int n(chunks.Size());
+        std::vector< std::unique_ptr<R> > results(n);
+        std::vector<bool> ready(n, false);
+        std::deque<unsigned int> completed;
+        bool failed(false);
+        std::mutex lock;
+        std::condition_variable done;
+        // declared last so outstanding tasks finish before the state above is destroyed
+        TaskGroup tasks;
+        unsigned int window(2*tasks.Size());
+        // results are handed over by pointer, so chunk data is never copied
+
+        unsigned int submitted(0);
+        auto submit = [&]() {
+            unsigned int i(submitted++);
+            tasks.Submit([&, i]() {
+                try {
+                    std::unique_ptr<R> result(new R(compute(i, chunks[i])));
+                    std::lock_guard<std::mutex> l(lock);
+                    results[i] = std::move(result);
+                    ready[i] = true;
+                    completed.push_back(i);
+                } catch(...) {
+                    std::lock_guard<std::mutex> l(lock);
+                    failed = true;
+                    done.notify_all();
+                    throw;
+                }
+                done.notify_all();
+            }, i % tasks.Size());
+        };
+        while (submitted < std::min(n, window)) submit();
+
+        for (unsigned int iWrite=0; iWrite<n; iWrite++) {
+            unsigned int i;
+            std::unique_ptr<R> result;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                if (ordered) {
+                    done.wait(l, [&]() { return failed || ready[iWrite]; });
+                    i = iWrite;
+                } else {
+                    done.wait(l, [&]() { return failed || !completed.empty(); });
+                    i = failed ? 0 : completed.front();
+                }
+                if (failed) break;
+                if (!ordered) completed.pop_front();
+                result = std::move(results[i]);
+            }
+            if (submitted < n) submit();
+            write(i, chunks[i], *result);
+        }
+        tasks.Wait();
+    }
+
+    //! Compute a partial result for every chunk in parallel and merge them into init
+    /*!
+        compute(iChunk, chunk) returns a partial result of type R, merge(R& total, const R& partial)
+        combines them.  Partials are merged in chunk order so results do not depend on thread count.
+    */
+    template<class R, class F, class M> R ReduceChunks(const ChunkSet& chunks, F compute, M merge, R init) {
+        std::vector< std::unique_ptr<R> > partials(chunks.Size());
+        ForEachChunk(chunks, [&](unsigned int i, const Rect<int>& chunk) {
+            partials[i].reset(new R(compute(i, chunk)));
+        });
+        for (unsigned int i=0; i<partials.size(); i++) merge(init, *partials[i]);
+        return init;
+    }
+
+} // namespace gip
+
+#endif
@@ -95,6 +95,26 @@ namespace gip {
         static void SetNumCores(int n) {
             _NumCores = n;
         }
+        //! Memory (MB) for chunks queued between reading, processing and writing
+        static float QueueSize() { return _QueueSize; }
+        //! Set memory (MB) for queued chunks
+        static void SetQueueSize(float sz) { _QueueSize = sz; }
+        //! Memory (MB) for caching chunks read from files (0, the default, leaves it to algorithms that reread chunks)
+        static float CacheSize() { return _CacheSize; }
+        //! Set memory (MB) for caching chunks read from files
+        static void SetCacheSize(float sz) { _CacheSize = sz; }
+        //! Keep statistics of files in sidecar files (filename.gipstats) across runs
+        static bool StatsCache() { return _StatsCache; }
+        //! Enable or disable sidecar statistics files
+        static void SetStatsCache(bool cache) { _StatsCache = cache; }
+        //! Stats() returns approximate statistics (from overviews or a sample)
+        static bool ApproxStats() { return _ApproxStats; }
+        //! Enable or disable approximate statistics
+        static void SetApproxStats(bool approx) { _ApproxStats = approx; }
+        //! Memory (MB) for scratch rasters kept in memory, larger ones go to files in WorkDir
+        static float ScratchSize() { return _ScratchSize; }
+        //! Set memory (MB) for in-memory scratch rasters
+        static void SetScratchSize(float sz) { _ScratchSize = sz; }
         //! Get workdir
         static std::string WorkDir() { return _WorkDir; }
         //! Set workdir
@@ -114,6 +134,16 @@ namespace gip {
         static int _NumCores;
         //! Work dir
         static std::string _WorkDir;
+        //! Memory budget for queued chunks
+        static float _QueueSize;
+        //! Memory budget for cached chunks
+        static float _CacheSize;
+        //! Use sidecar statistics files
+        static bool _StatsCache;
+        //! Use approximate statistics
+        static bool _ApproxStats;
+        //! Memory budget for scratch rasters
+        static float _ScratchSize;
 
     };
 
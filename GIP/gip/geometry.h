@@ -237,14 +237,20 @@ namespace gip {
     public:
         //! Default constructor
         ChunkSet()
-            : _xsize(0), _ysize(0), _padding(0) {
+            : _xsize(0), _ysize(0), _padding(0), _xblock(0), _yblock(0), _numchunks(0) {
             // std::cerr << "ChunkSet DefaultConstructor (x, y, pad) = (0, 0, 0)" << std::endl ;
             // std::cerr << "ChunkSet._Chunks.size() = " << _Chunks.size() << std::endl ;
         }
 
-        //! Constructor taking in image size
-        ChunkSet(unsigned int xsize, unsigned int ysize, unsigned int padding=0, unsigned int numchunks=0)
-            : _xsize(xsize), _ysize(ysize), _padding(padding) {
+        //! Constructor taking in image size, and optionally the natural block size to tile on
+        /*!
+            If xblock and yblock are given the region is split into 2D tiles that are whole
+            multiples of the block size (e.g., the tile size of a tiled GeoTIFF), so that each
+            block is only read once.  Otherwise the region is split into full width strips.
+        */
+        ChunkSet(unsigned int xsize, unsigned int ysize, unsigned int padding=0, unsigned int numchunks=0,
+                 unsigned int xblock=0, unsigned int yblock=0)
+            : _xsize(xsize), _ysize(ysize), _padding(padding), _xblock(xblock), _yblock(yblock), _numchunks(numchunks) {
             // std::cerr << "ChunkSet SpecificConstructor (x, y, pad, numchunks) = ("
             //           << _xsize << ", " << _ysize << ", " << _padding << ", " << numchunks << ")" << std::endl ;
             ChunkUp(numchunks);
@@ -252,7 +258,8 @@ namespace gip {
 
         //! Copy constructor
         ChunkSet(const ChunkSet& chunks)
-            : _xsize(chunks._xsize), _ysize(chunks._ysize), _padding(chunks._padding) {
+            : _xsize(chunks._xsize), _ysize(chunks._ysize), _padding(chunks._padding),
+              _xblock(chunks._xblock), _yblock(chunks._yblock), _numchunks(chunks._numchunks) {
             // std::cerr << "ChunkSet CopyConstructor (x, y, pad) = ("
             //           << _xsize << ", " << _ysize << ", " << _padding << ")" << std::endl ;
             _Chunks = chunks._Chunks ;
@@ -267,6 +274,9 @@ namespace gip {
             _xsize = chunks._xsize;
             _ysize = chunks._ysize;
             _padding = chunks._padding;
+            _xblock = chunks._xblock;
+            _yblock = chunks._yblock;
+            _numchunks = chunks._numchunks;
             _Chunks = chunks._Chunks ;
             int size(_Chunks.size()) ;
             // std::cerr << "ChunkSet CopyConstructor (x, y, pad, _chunks.size()) = ("
@@ -298,10 +308,19 @@ namespace gip {
         //! Set padding
         ChunkSet& Padding(unsigned int _pad) {
             _padding = _pad;
-            ChunkUp(_Chunks.size());
+            ChunkUp(Blocked() ? _numchunks : _Chunks.size());
             return *this;
         }
 
+        //! Determine if chunks are tiles aligned to the natural block size
+        bool Blocked() const { return (_xblock > 0 && _yblock > 0); }
+
+        //! Get natural block width chunks are aligned to (0 if not block aligned)
+        unsigned int XBlockSize() const { return _xblock; }
+
+        //! Get natural block height chunks are aligned to (0 if not block aligned)
+        unsigned int YBlockSize() const { return _yblock; }
+
         //! Get a chunk
         Rect<int>& operator[](unsigned int index) { 
             // Call const version
@@ -317,6 +336,7 @@ namespace gip {
     private:
         //! Function to chunk up region
         std::vector< Rect<int> > ChunkUp(unsigned int numchunks=0) {
+            if (Blocked()) return ChunkUpBlocks(numchunks);
             unsigned int rows;
 
             if (numchunks == 0) {
@@ -342,12 +362,53 @@ namespace gip {
             return _Chunks;            
         }
 
+        //! Function to chunk up region into tiles that are whole multiples of the block size
+        std::vector< Rect<int> > ChunkUpBlocks(unsigned int numchunks=0) {
+            // number of blocks across and down the region
+            unsigned int nbx = ceil( XSize()/(float)_xblock );
+            unsigned int nby = ceil( YSize()/(float)_yblock );
+            // tile size, in blocks
+            unsigned int bx, by;
+
+            if (numchunks == 0) {
+                // as many blocks as fit in chunk size, filling complete rows of blocks first
+                double maxblocks = floor( (Options::ChunkSize() *1024*1024) / sizeof(double) / ((double)_xblock*_yblock) );
+                unsigned int blocks = maxblocks < 1 ? 1 : (maxblocks > nbx*nby ? nbx*nby : maxblocks);
+                bx = std::min(nbx, blocks);
+                by = std::max(1u, std::min(nby, blocks/bx));
+            } else {
+                // split rows of blocks first, then columns if more chunks are requested
+                unsigned int ychunks = std::min(numchunks, nby);
+                unsigned int xchunks = std::min((unsigned int)ceil(numchunks/(float)ychunks), nbx);
+                by = ceil(nby/(float)ychunks);
+                bx = ceil(nbx/(float)xchunks);
+            }
+
+            _Chunks.clear();
+            Rect<int> chunk;
+            unsigned int width(bx*_xblock), height(by*_yblock);
+            for (unsigned int y=0; y<YSize(); y+=height) {
+                for (unsigned int x=0; x<XSize(); x+=width) {
+                    chunk = Rect<int>(x, y, std::min(x+width,XSize())-x, std::min(y+height,YSize())-y);
+                    chunk.Padding(_padding);
+                    _Chunks.push_back(chunk);
+                }
+            }
+            return _Chunks;
+        }
+
         //! Width (columns) of region
         unsigned int _xsize;
         //! Height (rows) of region
         unsigned int _ysize;
         //! Padding to apply to rects (dimensions are always the rect without padding)
         unsigned int _padding;
+        //! Natural block width to align chunks to (0 for full width strips)
+        unsigned int _xblock;
+        //! Natural block height to align chunks to (0 for full width strips)
+        unsigned int _yblock;
+        //! Number of chunks requested (0 for automatic based on chunk size)
+        unsigned int _numchunks;
 
         //! Coordinates of the chunks
         std::vector< Rect<int> > _Chunks;
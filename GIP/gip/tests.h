@@ -32,6 +32,24 @@ namespace gip {
 
     GeoImage test_padded_chunk_registration(int=5, int=10);
 
+    bool test_block_chunking(int=256, int=256, int=0);
+
+    bool test_band_math();
+
+    bool test_indices_quantization();
+
+    bool test_moments_merge();
+
+    bool test_percentiles();
+
+    bool test_joint_covariance();
+
+    bool test_expression_parsing();
+
+    bool test_morphology();
+
+    bool test_pixel_sampling();
+
     /*template<class T> CImg<T> _test(CImg<T> cimg) {
         //std::cout << "GIPPY CImg input/output test" << std::endl;
         //std::cout << "typeid = " << typeid(T) << std::endl;
@@ -20,8 +20,13 @@
 ##############################################################################*/
 
 #include <iostream>
+#include <random>
+#include <algorithm>
 #include <gip/tests.h>
 #include <gip/Utils.h>
+#include <gip/GeoAlgorithms.h>
+#include <gip/Expression.h>
+#include <gip/Morphology.h>
 
 namespace gip {
     using std::string;
@@ -95,5 +100,316 @@ namespace gip {
         return img;
     }
 
+    bool test_block_chunking(int xblock, int yblock, int chunk) {
+        cout << "Block chunking test with " + to_string(xblock) + "x" + to_string(yblock) + " blocks and "
+            + to_string(chunk) + " chunks" << endl;
+        unsigned int xsize(1000), ysize(700);
+        ChunkSet chunks(xsize, ysize, 0, chunk, xblock, yblock);
+        // Every tile is aligned to blocks and every pixel is covered exactly once
+        CImg<unsigned char> coverage(xsize, ysize, 1, 1, 0);
+        bool success = chunks.Valid();
+        for (unsigned int i=0; i<chunks.Size(); i++) {
+            if ((chunks[i].x0() % xblock) || (chunks[i].y0() % yblock)) success = false;
+            if ((chunks[i].x1() % xblock) && (chunks[i].x1() != (int)xsize)) success = false;
+            if ((chunks[i].y1() % yblock) && (chunks[i].y1() != (int)ysize)) success = false;
+            for (int y=chunks[i].y0(); y<chunks[i].y1(); y++)
+                for (int x=chunks[i].x0(); x<chunks[i].x1(); x++) coverage(x,y)++;
+        }
+        if (coverage.min() != 1 || coverage.max() != 1) success = false;
+        if (success)
+            cout << "Test succeeded" << endl;
+        else cout << "Test failed" << endl;
+        return success;
+    }
+
+    bool test_band_math() {
+        cout << "Band math test" << endl;
+        GeoImage img("test_band_math.tif", 100, 100, 2, GDT_Int16);
+        CImg<short> red(100, 100), nir(100, 100);
+        cimg_forXY(red,x,y) {
+            red(x,y) = x + 1;
+            nir(x,y) = y + 1;
+        }
+        red(10,10) = -1;
+        img[0].SetNoData(-1);
+        img[1].SetNoData(-1);
+        img[0].Write(red);
+        img[1].Write(nir);
+        GeoRaster ndvi = (img[1] - img[0]) / (img[1] + img[0]);
+        CImg<float> result = ndvi.Read<float>();
+        bool success = true;
+        cimg_forXY(result,x,y) {
+            float expected = (x == 10 && y == 10) ? -1.0 : (float)(y - x) / (x + y + 2);
+            if (std::abs(result(x,y) - expected) > 1e-6) success = false;
+        }
+        if (success)
+            cout << "Test succeeded" << endl;
+        else cout << "Test failed" << endl;
+        return success;
+    }
+
+    bool test_indices_quantization() {
+        cout << "Indices quantization test" << endl;
+        GeoImage img("test_indices_input.tif", 5, 1, 1, GDT_Float32);
+        img.SetBandName("NIR", 1);
+        img[0].SetNoData(-9999);
+        img[0].Write(CImg<float>(5, 1, 1, 1, 0.00016, -0.00016, 10.0, -10.0, -9999.0));
+        dictionary products, expressions;
+        products["nir"] = "test_indices_nir.tif";
+        expressions["nir"] = "NIR";
+        dictionary filenames = algorithms::Indices(img, products, dictionary(), expressions);
+        CImg<short> result = GeoImage(filenames["nir"])[0].ReadRaw<short>();
+        // rounded to nearest (as GDAL converts floats written to Int16), clamped clear of nodata
+        CImg<short> expected(5, 1, 1, 1, 2, -2, 32767, -32767, -32768);
+        bool success = (result == expected);
+        if (success)
+            cout << "Test succeeded" << endl;
+        else cout << "Test failed" << endl;
+        return success;
+    }
+
+    bool test_moments_merge() {
+        cout << "Moments merge test" << endl;
+        std::mt19937 rng(1);
+        std::normal_distribution<double> dist(50, 10);
+        const double nodata(-9999);
+        std::vector<double> data(1000);
+        for (unsigned int i=0; i<data.size(); i++) data[i] = dist(rng);
+        // third chunk has no data at all
+        for (unsigned int i=500; i<750; i++) data[i] = nodata;
+        data[10] = nodata;
+        Moments single, merged;
+        single.Add(&data[0], data.size(), true, nodata);
+        for (unsigned int i=0; i<data.size(); i+=250) {
+            Moments chunk;
+            chunk.Add(&data[i], 250, true, nodata);
+            merged.Merge(chunk);
+        }
+        bool success = (single.Count() == 749) && (merged.Count() == single.Count())
+            && (merged.Min() == single.Min()) && (merged.Max() == single.Max())
+            && (std::abs(merged.Mean() - single.Mean()) < 1e-9)
+            && (std::abs(merged.Variance() - single.Variance()) < 1e-9 * single.Variance())
+            && (std::abs(merged.Skewness() - single.Skewness()) < 1e-9);
+        if (success)
+            cout << "Test succeeded" << endl;
+        else cout << "Test failed" << endl;
+        return success;
+    }
+
+    bool test_percentiles() {
+        cout << "Percentiles test" << endl;
+        std::mt19937 rng(2);
+        std::vector<float> p = {0, 1, 10, 25, 50, 75, 90, 99.5, 100};
+        bool success = true;
+        // 8 bit data is counted exactly, compare with interpolating a sorted array
+        GeoImage byteimg("test_percentiles_byte.tif", 60, 40, 1, GDT_Byte);
+        byteimg[0].SetNoData(0);
+        CImg<unsigned char> bytes(60, 40);
+        std::vector<double> sorted;
+        cimg_forXY(bytes,x,y) {
+            bytes(x,y) = rng() % 256;
+            if (bytes(x,y)) sorted.push_back(bytes(x,y));
+        }
+        byteimg[0].Write(bytes);
+        std::sort(sorted.begin(), sorted.end());
+        CImg<float> result = byteimg[0].Percentiles(p);
+        for (unsigned int i=0; i<p.size(); i++) {
+            double rank(p[i]/100.0 * (sorted.size() - 1));
+            unsigned int lo(std::floor(rank)), hi(std::min(lo + 1, (unsigned int)sorted.size() - 1));
+            double expected(sorted[lo] + (rank - lo) * (sorted[hi] - sorted[lo]));
+            if (std::abs(result[i] - expected) > 1e-4) success = false;
+        }
+        // floating point data is sketched, the rank of each value must be within error
+        float error(0.01);
+        GeoImage floatimg("test_percentiles_float.tif", 200, 150, 1, GDT_Float32);
+        floatimg[0].SetNoData(-9999);
+        CImg<float> floats(200, 150);
+        std::exponential_distribution<float> dist(1);
+        cimg_forXY(floats,x,y) floats(x,y) = dist(rng);
+        floatimg[0].Write(floats);
+        std::vector<float> values(floats.data(), floats.data() + floats.size());
+        std::sort(values.begin(), values.end());
+        result = floatimg[0].Percentiles(p, error);
+        for (unsigned int i=0; i<p.size(); i++) {
+            double below((std::lower_bound(values.begin(), values.end(), result[i]) - values.begin()) / (double)values.size());
+            double upto((std::upper_bound(values.begin(), values.end(), result[i]) - values.begin()) / (double)values.size());
+            if (below > p[i]/100.0 + error || upto < p[i]/100.0 - error) success = false;
+        }
+        if (success)
+            cout << "Test succeeded" << endl;
+        else cout << "Test failed" << endl;
+        return success;
+    }
+
+    bool test_joint_covariance() {
+        cout << "Joint covariance test" << endl;
+        std::mt19937 rng(3);
+        std::normal_distribution<float> dist(0, 1);
+        unsigned int nb(3), xs(37), ys(23);
+        GeoImage img("test_joint_covariance.tif", xs, ys, nb, GDT_Float32);
+        CImg<float> cube(xs, ys, 1, nb);
+        cimg_forXY(cube,x,y) {
+            float a(dist(rng)), b(dist(rng));
+            cube(x,y,0,0) = 100 + 3*a;
+            cube(x,y,0,1) = 50 + 2*a + b;
+            cube(x,y,0,2) = -b;
+        }
+        // pixels missing from any band are left out of every band
+        cube(0,0,0,0) = -9999;
+        cube(5,7,0,1) = -9999;
+        cube(xs-1,ys-1,0,2) = -9999;
+        for (unsigned int b=0; b<nb; b++) {
+            img[b].SetNoData(-9999);
+            img[b].Write(cube.get_channel(b));
+        }
+        JointMoments moments = img.JointStats(true);
+        // direct two pass computation
+        std::vector<std::vector<double> > pixels;
+        cimg_forXY(cube,x,y) {
+            std::vector<double> pixel(nb);
+            bool valid(true);
+            for (unsigned int b=0; b<nb; b++) {
+                pixel[b] = cube(x,y,0,b);
+                if (pixel[b] == -9999) valid = false;
+            }
+            if (valid) pixels.push_back(pixel);
+        }
+        std::vector<double> mean(nb, 0);
+        for (unsigned int i=0; i<pixels.size(); i++)
+            for (unsigned int b=0; b<nb; b++) mean[b] += pixels[i][b] / pixels.size();
+        bool success = (moments.Count() == pixels.size());
+        for (unsigned int b0=0; b0<nb; b0++) {
+            if (std::abs(moments[b0].Mean() - mean[b0]) > 1e-6) success = false;
+            for (unsigned int b1=0; b1<nb; b1++) {
+                double cov(0);
+                for (unsigned int i=0; i<pixels.size(); i++)
+                    cov += (pixels[i][b0] - mean[b0]) * (pixels[i][b1] - mean[b1]);
+                cov /= (pixels.size() - 1);
+                if (std::abs(moments.Covariance(b0, b1) - cov) > 1e-6 * (1 + std::abs(cov))) success = false;
+            }
+        }
+        if (success)
+            cout << "Test succeeded" << endl;
+        else cout << "Test failed" << endl;
+        return success;
+    }
+
+    bool test_expression_parsing() {
+        cout << "Expression parsing test" << endl;
+        float a(3), b(2);
+        const float* vars[] = {&a, &b};
+        // expression, expected value with a=3 and b=2
+        std::vector<std::pair<std::string, float> > cases = {
+            {"-a^2", -9}, {"2^3^2", 512}, {"a*-b", -6}, {"a-b-1", 0}, {"a/b/2", 0.75},
+            {"a+b*2", 7}, {"(a+b)*2", 10}, {"-(a-b)^2", -1}, {"max(a,b)-min(a,b)", 1}
+        };
+        bool success = true;
+        for (unsigned int i=0; i<cases.size(); i++) {
+            Expression expr(cases[i].first);
+            std::vector<const float*> used;
+            for (unsigned int v=0; v<expr.Variables().size(); v++)
+                used.push_back(expr.Variables()[v] == "a" ? vars[0] : vars[1]);
+            float result;
+            expr.Evaluate(used.empty() ? NULL : &used[0], 1, &result);
+            if (std::abs(result - cases[i].second) > 1e-5) {
+                cout << cases[i].first << " = " << result << ", expected " << cases[i].second << endl;
+                success = false;
+            }
+        }
+        std::vector<std::string> errors = {"", "(a", "a)", "a+", "a b", "2^", "max(a)", "sqrt a", "a $ b"};
+        for (unsigned int i=0; i<errors.size(); i++) {
+            try {
+                Expression expr(errors[i]);
+                cout << "\"" << errors[i] << "\" parsed" << endl;
+                success = false;
+            } catch(std::runtime_error&) {}
+        }
+        if (success)
+            cout << "Test succeeded" << endl;
+        else cout << "Test failed" << endl;
+        return success;
+    }
+
+    bool test_morphology() {
+        cout << "Morphology test" << endl;
+        std::mt19937 rng(4);
+        bool success = true;
+        // against CImg, for rectangles smaller than the image
+        for (unsigned int i=0; i<200; i++) {
+            int xs(2 + rng() % 30), ys(2 + rng() % 30);
+            unsigned int sx(1 + rng() % (xs - 1)), sy(1 + rng() % (ys - 1));
+            CImg<unsigned char> img(xs, ys);
+            // binary and grey images take different paths
+            cimg_forXY(img,x,y) img(x,y) = (i % 2) ? (rng() % 4 == 0) : rng() % 200;
+            CImg<unsigned char> eroded(img), dilated(img);
+            Erode(eroded, sx, sy);
+            Dilate(dilated, sx, sy);
+            if (eroded != img.get_erode(sx, sy) || dilated != img.get_dilate(sx, sy)) success = false;
+        }
+        // a single cloud pixel is projected onto the pixels behind it along the direction
+        CImg<unsigned char> cloud(20, 20, 1, 1, 0), expected(20, 20, 1, 1, 0);
+        cloud(10,10) = 1;
+        for (int k=0; k<=4; k++) expected(10-k,10) = 1;
+        CImg<unsigned char> horizontal(cloud);
+        if (ProjectMask(horizontal, 4, 0) != expected) success = false;
+        expected.fill(0);
+        for (int k=0; k<=3; k++) expected(10-k,10-k) = 1;
+        CImg<unsigned char> diagonal(cloud);
+        if (ProjectMask(diagonal, 3, 3) != expected) success = false;
+        expected.fill(0);
+        expected(10,10) = 1;
+        for (int k=2; k<=4; k++) expected(10,10+k) = 1;
+        CImg<unsigned char> heights(cloud);
+        if (ProjectMask(heights, 0, -4, 0.5) != expected) success = false;
+        if (success)
+            cout << "Test succeeded" << endl;
+        else cout << "Test failed" << endl;
+        return success;
+    }
+
+    bool test_pixel_sampling() {
+        cout << "Pixel sampling test" << endl;
+        unsigned int xs(30), ys(20);
+        GeoImage img("test_pixel_sampling.tif", xs, ys, 2, GDT_Int16);
+        CImg<short> b0(xs, ys), b1(xs, ys);
+        // every pixel value is unique, a third of the pixels lack data in one band
+        unsigned int valid(0);
+        cimg_forXY(b0,x,y) {
+            b0(x,y) = 1 + x + 100*y;
+            b1(x,y) = b0(x,y);
+            if ((x + y) % 3 == 0) b0(x,y) = -1;
+            else if ((x + 2*y) % 7 == 0) b1(x,y) = -1;
+            else valid++;
+        }
+        img[0].SetNoData(-1);
+        img[1].SetNoData(-1);
+        img[0].Write(b0);
+        img[1].Write(b1);
+        bool success = true;
+        // seeded samples are reproducible and have data in every band
+        for (int stratified=0; stratified<2; stratified++) {
+            CImg<float> sample = img.GetRandomPixels<float>(50, stratified, 7);
+            if (sample != img.GetRandomPixels<float>(50, stratified, 7) || sample.height() != 50) success = false;
+            cimg_forY(sample,p) if (sample(0,p) == -1 || sample(0,p) != sample(1,p)) success = false;
+        }
+        // reservoirs hold min(N, valid) distinct pixels with data
+        std::vector<int> sizes = {0, 1, 100, (int)valid, (int)valid + 50};
+        for (unsigned int i=0; i<sizes.size(); i++) {
+            CImg<float> sample = img.GetReservoirPixels<float>(sizes[i], 11);
+            if (sample.height() != std::min(sizes[i], (int)valid)) success = false;
+            if (sample != img.GetReservoirPixels<float>(sizes[i], 11)) success = false;
+            std::vector<float> seen;
+            cimg_forY(sample,p) {
+                if (sample(0,p) == -1 || sample(0,p) != sample(1,p)) success = false;
+                seen.push_back(sample(0,p));
+            }
+            std::sort(seen.begin(), seen.end());
+            if (std::unique(seen.begin(), seen.end()) != seen.end()) success = false;
+        }
+        if (success)
+            cout << "Test succeeded" << endl;
+        else cout << "Test failed" << endl;
+        return success;
+    }
 
 } // namespace gip
@@ -25,6 +25,7 @@
 namespace std {
     %template(vectors) std::vector<std::string>;
     %template(vectori) std::vector<int>;
+    %template(vectorf) std::vector<float>;
     %template(mapss) std::map<std::string, std::string>;
 }
 
@@ -85,6 +86,16 @@ namespace gip {
         static void SetVerbose(int v);
         static int NumCores();
         static void SetNumCores(int n);
+        static float QueueSize();
+        static void SetQueueSize(float sz);
+        static float CacheSize();
+        static void SetCacheSize(float sz);
+        static bool StatsCache();
+        static void SetStatsCache(bool cache);
+        static bool ApproxStats();
+        static void SetApproxStats(bool approx);
+        static float ScratchSize();
+        static void SetScratchSize(float sz);
         static std::string WorkDir();
         static void SetWorkDir(std::string workdir);
     };
@@ -181,6 +192,7 @@ namespace gip {
 
 // GeoImage
 %ignore gip::GeoImage::operator[];
+%ignore gip::GeoImage::JointStats;
 %include "gip/GeoImage.h"
 namespace gip {
     %extend GeoImage {
@@ -218,11 +230,14 @@ namespace gip {
         PyObject* Extract(const GeoRaster& mask) {
             return CImgToArr(self->Extract<double>(mask));
         }
-        PyObject* GetRandomPixels(int NumPixels) {
-            return CImgToArr(self->GetRandomPixels<double>(NumPixels));
+        PyObject* GetRandomPixels(int NumPixels, bool stratified=false, unsigned int seed=0) {
+            return CImgToArr(self->GetRandomPixels<double>(NumPixels, stratified, seed));
         }
-        PyObject* GetPixelClasses(int NumClasses) {
-            return CImgToArr(self->GetPixelClasses<double>(NumClasses));
+        PyObject* GetReservoirPixels(int NumPixels, unsigned int seed=0) {
+            return CImgToArr(self->GetReservoirPixels<double>(NumPixels, seed));
+        }
+        PyObject* GetPixelClasses(int NumClasses, unsigned int seed=0) {
+            return CImgToArr(self->GetPixelClasses<double>(NumClasses, seed));
         }
         GeoImage __deepcopy__(GeoImage image) {
             return GeoImage(image);
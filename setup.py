@@ -153,6 +153,12 @@ if gdal_config.version()[0] == 2:
 
 extra_link_args = gdal_config.extra_link_args
 
+# optional system BLAS for covariance kernels, e.g. GIP_CBLAS=openblas
+cblas_libs = []
+if os.environ.get('GIP_CBLAS'):
+    extra_compile_args.append('-DGIP_CBLAS')
+    cblas_libs.append(os.environ['GIP_CBLAS'])
+
 if sys.platform == 'darwin':
     extra_compile_args.append('-stdlib=libc++')
     extra_link_args.append('-stdlib=libc++')
@@ -178,7 +184,7 @@ gip_module =  Extension(
     library_dirs=gdal_config.lib_dirs,
     libraries=[
         'boost_log', 'boost_system', 'boost_filesystem', 'pthread'
-    ] + gdal_config.libs,
+    ] + gdal_config.libs + cblas_libs,
     extra_compile_args=extra_compile_args,
     extra_link_args=extra_link_args
 )